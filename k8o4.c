@@ -1,4 +1,4 @@
-// cc k8o4.c -o k8o4 -Wall -Wextra -pedantic -std=c99
+// cc k8o4.c -o k8o4 -Wall -Wextra -pedantic -std=c99 -pthread
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _GNU_SOURCE
@@ -6,20 +6,52 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #define VSCODE_CLI_VERSION "1.2.1"
 #define TAB_STOP 4
 #define QUIT_TIMES 2
-#define MAX_UNDO 1000
+#define UNDO_CHUNK (64 * 1024)
+#define UNDO_MAX_BYTES (32 * 1024 * 1024)
+#define LAZY_OPEN_THRESHOLD (16 * 1024 * 1024)
+#define LARGE_FILE_SIZE (256LL * 1024 * 1024)  // K8O4_LARGE_SIZE overrides
+#define LARGE_FILE_LINES 1000000               // K8O4_LARGE_LINES overrides
+#define VIEW_ROWS 256  // A power of two
+#define FOLLOW_BATCH (16 * 1024 * 1024)  // Bytes appended per wakeup at most
+#define DISK_CHECK_MS 1000  // How often keys check the file for outside changes
+#define DIFF_MAX_EDITS 1024  // Beyond this many line edits, replace the lot
+#define RENDER_CACHE_ROWS 4096
+#define JOURNAL_SYNC_MS 500
+#define SAVE_IOVS 1024
+#define SAVE_CHUNK (4 * 1024 * 1024)
+#define HL_FRAME_BUDGET 2048
+#define FIND_ASYNC_ROWS 65536
+#define FIND_JOB_ROWS 8192
+#define FIND_MAX_THREADS 16
+#define FIND_NARROW_WALK 64   // Step this many rows to the next match, not look it up
+#define FIND_NARROW_DENSE 2   // Rescan, not narrow, past rows / this many matches
 #define PL_RIGHT_ARROW "\uE0B0"
 #define COLOR_BG            "\x1b[48;2;30;30;30m"
 #define COLOR_FG            "\x1b[38;2;212;212;212m"
@@ -45,6 +77,7 @@ enum editorKey {
   SHIFT_HOME_KEY, SHIFT_END_KEY,
   CTRL_SHIFT_ARROW_LEFT, CTRL_SHIFT_ARROW_RIGHT,
   CTRL_DEL_KEY,
+  PASTE_START, PASTE_END,
 };
 enum editorHighlight {
   HL_NORMAL = 0, HL_COMMENT, HL_MLCOMMENT, HL_KEYWORD1, HL_KEYWORD2,
@@ -52,53 +85,267 @@ enum editorHighlight {
 };
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+// Keywords compiled into a trie over the bytes they use. cls maps a byte to
+// its column in next (0 for bytes in no keyword), next[node * width + col]
+// is the child (0 for none; node 0 is the root), and hl/rank give the class
+// and list position of the keyword ending at a node, hl being 0 if none.
+typedef struct keywordTrie {
+  unsigned char cls[256]; int width;
+  short *next; unsigned char *hl; short *rank;
+} keywordTrie;
 struct editorSyntax {
   char *filetype; char **filematch; char **keywords;
   char *singleline_comment_start; char *multiline_comment_start;
   char *multiline_comment_end; int flags;
+  keywordTrie *trie;  // keywords, compiled when the syntax is first selected
 };
+// render and hl are caches rebuilt on demand by editorRenderRow: dirty
+// marks them stale, and rows holding them sit on an LRU list so cold rows
+// can give the memory back. hl_start and hl_open_comment checkpoint the
+// lexer state the row was last lexed from and ended in; hl_stale means the
+// text changed since, so the end state must be lexed again.
 typedef struct erow {
-  int idx; int size; int rsize; char *chars; char *render;
-  unsigned char *hl; int hl_open_comment;
+  int size; int rsize; char *chars; char *render;
+  unsigned char *hl; int hl_start, hl_open_comment, hl_stale;
+  int dirty;
+  unsigned shared;  // save_gen of a save writing chars out, which then stays
+  struct erow *lru_prev, *lru_next;
 } erow;
 
-// Undo/Redo system
+// Row store: an implicit treap keyed by line number. Each node owns one erow
+// (always the first member, so an erow* is also its node*), subtree counts
+// give O(log n) lookup, insert and delete by index, and prev/next thread the
+// nodes in line order so neighbours and full scans never need an index.
+// A node with src >= 0 is an unmaterialized span of `lines` lines that still
+// live in the mmapped file (see editorOpenMapped); it is cut down to a real
+// row the first time one of its lines is looked up.
+typedef struct rowNode {
+  erow row;
+  struct rowNode *left, *right, *parent;
+  struct rowNode *prev, *next;
+  unsigned int prio; int count;
+  int lines; int src;
+  int stale;  // Rows in this subtree with hl_stale set
+  unsigned gen;  // save_gen when made; older nodes are in a running save
+} rowNode;
+
+// A screen cell: one UTF-8 sequence, drawn one column wide, and its colours
+// as indices into E.sgr (0 is the terminal default). A cell with len 0 is
+// unknown and never equal to a drawn one.
+typedef struct screenCell {
+  char ch[4]; unsigned char len, fg, bg;
+} screenCell;
+#define SCREEN_STYLES 64
+
+// Search results (see editorFindCallback): every match of the query in
+// buffer order. Each level holds the matches of one query length; a level
+// typed on top of another keeps the matches of the one below that still
+// match. col and len are in chars, or in render columns when level->render.
+// Regex searches keep a single level, as a longer pattern can match more.
+typedef struct findMatch { int row, col, len; } findMatch;
+typedef struct findVec { findMatch *m; int n, cap; } findVec;
+typedef struct findLevel { int qlen, start, count, render; } findLevel;
+typedef struct findSpan { int from, to; } findSpan;
+// A full scan of a large buffer runs on worker threads (see findScanStart).
+// The rows are cut into jobs of FIND_JOB_ROWS rows that workers claim in
+// order; each finished job is pushed as a batch onto the lock-free done
+// stack, and the UI thread appends batches to the level in job order.
+typedef struct findBatch { struct findBatch *next; int job; findVec v; } findBatch;
+typedef struct regex regex;
+typedef struct regexMatcher regexMatcher;
+typedef struct findScan {
+  char *query; int qlen, render;
+  regex *re;                     // Pattern for regex searches, else NULL
+  int njobs, next_job, cancel;   // next_job and cancel are shared with workers
+  findBatch *done;               // Finished batches, pushed by workers
+  findBatch **ready; int appended;  // Batches by job; jobs in the level so far
+  pthread_t tid[FIND_MAX_THREADS]; int nthreads;
+} findScan;
+typedef struct findState {
+  char *query; int query_cap;    // Query the levels are prefixes of
+  findVec found;
+  findLevel *level; int nlevels, level_cap;
+  findScan *scan;                // Scan filling the bottom level, or NULL
+  int current;                   // Index into the top level
+  int regex;                     // Query is a regular expression
+  regex *re; regexMatcher *rm;   // The compiled query, if valid
+  const char *error;             // Why the query doesn't compile, or NULL
+} findState;
+
+// Undo/Redo system. Each record is one undo step; typing, deleting and
+// pressing Enter extend the last record while they continue where it left
+// off, so a word or a burst of Enters is undone at once.
 enum undoType {
-  UNDO_INSERT_CHAR,
-  UNDO_DELETE_CHAR,
-  UNDO_INSERT_NEWLINE,
-  UNDO_DELETE_NEWLINE,
-  UNDO_DELETE_SELECTION,
+  UNDO_INSERT_CHAR,     // text typed on row cy from cx
+  UNDO_DELETE_CHAR,     // text deleted from row cy at cx
+  UNDO_INSERT_NEWLINE,  // len newlines entered at (cy, cx)
+  UNDO_DELETE_NEWLINE,  // Row cy + 1 joined onto row cy, which was cx long
+  UNDO_DELETE_SELECTION,  // text, lines split by '\n', deleted from (cy, cx)
+  UNDO_REPLACE_ALL,     // text (len) replaced by with (with_len) at matches
+  UNDO_INSERT_TEXT,     // text, lines split by '\n', pasted at (cy, cx)
+  UNDO_INSERT_LINES,    // text pasted as new rows from cy, past the end
+  UNDO_DELETE_LINES,    // text deleted as whole rows from cy to the end
 };
 
-typedef struct undoState {
-  enum undoType type;
+// A record in the undo arena: this header, num_matches findMatches, len +
+// with_len bytes of text, padding, and the record's size in its last 8
+// bytes, so the history can be walked back as well as forward.
+typedef struct undoRecord {
+  int type;
   int cy, cx;           // Position where change occurred
   int prev_cy, prev_cx; // Cursor position before operation
-  char c;               // For single char operations
-  char *text;           // For multi-char/line operations
-  int text_len;
-  // For selection deletions
-  int sel_start_cy, sel_start_cx;
-  int sel_end_cy, sel_end_cx;
-  char **lines;         // Deleted lines content
-  int num_lines;
-  struct undoState *prev;
-  struct undoState *next;
-} undoState;
+  int len, with_len, num_matches;
+  int reload;           // Part of a reload: 1 on its first record, 2 after
+} undoRecord;
+// Records are packed into a chain of chunks, oldest first. Chunks are freed
+// from the front once the history holds more than UNDO_MAX_BYTES.
+typedef struct undoChunk {
+  struct undoChunk *prev, *next;
+  size_t used, cap;
+  char data[];
+} undoChunk;
+
+#define FRAME_RATE 120  // Frames a second at most
+#define ESC_TIMEOUT 50  // ms to wait for the rest of an escape sequence
+// Terminal input is read in large chunks into a ring buffer and decoded a
+// batch at a time into a queue of keys. Escape sequences are decoded by a
+// state machine compiled from escapeKeys: next[state][byte] is the state
+// after byte (0 if no sequence goes on so), key[state] the key a complete
+// sequence stands for. Ring and queue positions run freely.
+#define INPUT_RING 65536  // A power of two, as is INPUT_KEYS
+#define INPUT_KEYS 1024
+#define INPUT_STATES 64
+typedef struct inputState {
+  unsigned char ring[INPUT_RING]; unsigned head, tail;
+  int keys[INPUT_KEYS]; unsigned key_head, key_tail;
+  unsigned char next[INPUT_STATES][128]; int key[INPUT_STATES], nstates;
+} inputState;
+
+// Crash-recovery journal: every change to the rows is appended, as it
+// happens, to a swap file next to the file, .NAME.k8o4.swp. Changes are
+// only copied into buf on the editing thread; a writer thread takes them
+// in batches every JOURNAL_SYNC_MS, writes them and fsyncs. The swap file
+// starts with a journalHeader naming the version of the file the changes
+// apply to, followed by batches, each a journalBatch and len bytes of
+// records: a journalRecord and size bytes of text.
+enum journalType {
+  J_INSERT_ROW,    // Row a inserted, holding the text
+  J_INSERT_LINES,  // Rows from a inserted, the lines of the text
+  J_DEL_ROWS,      // Rows [a, a + b) deleted
+  J_ROW_INSERT,    // Text inserted in row a at b
+  J_ROW_DELETE,    // c bytes deleted from row a at b
+  J_REPLACE,       // The a findMatches in the text replaced by the rest of it
+};
+typedef struct journalHeader {
+  char magic[8]; long long size, mtime_sec, mtime_nsec;
+} journalHeader;
+typedef struct journalBatch { unsigned long long len; unsigned sum, pad; } journalBatch;
+typedef struct journalRecord { int size, type, a, b, c; } journalRecord;
+typedef struct journal {
+  char *path;             // NULL while changes are not journaled
+  journalHeader base;     // The version of the file changes apply to
+  int fd;                 // -1 until the writer creates the swap file
+  char *buf; size_t len, cap;  // Records the writer hasn't taken yet
+  int started, syncing;   // Writer running; a batch is being written
+  char *since; size_t since_len, since_cap;  // Changes after a save's snapshot
+  int keep_since;         // A save is running: collect them
+} journal;
+
+// A save in progress: a snapshot of the rows, written to path by a saver
+// thread while editing goes on. The snapshot is the row tree as it was, so
+// taking it is O(1); until the save is over a node it holds is copied
+// before it changes (rowNodeOwn) and kept when it is freed.
+typedef struct saveJob {
+  char *path;
+  rowNode *root; int rows;  // The tree and its lines when the snapshot was taken
+  const char *map; size_t map_size; const size_t *line_off;  // What spans read
+  unsigned gen;             // Nodes and row text older than this are in it
+  long long changes;        // E.changes when the snapshot was taken
+  void **kept; size_t nkept, kept_cap;  // Nodes and row text since replaced or freed
+  pthread_t tid; int threaded;
+  size_t total; int done_rows, done, error;  // Set by the saver
+} saveJob;
+
+// Follow mode (Ctrl-T): the file is watched with inotify and what is
+// written past its end is appended as rows. When it is truncated or a new
+// file takes its name, as when a log is rotated, it is loaded again.
+typedef struct follow {
+  int ifd;               // inotify instance, -1 when not following
+  int fd; off_t size;    // The file followed and how much of it is in the rows
+  int pending;           // More was written than one batch took in
+} follow;
+
+// Explorer sidebar: the entries of a directory, directories first and
+// then by name, read by a loader thread and then kept up to date from
+// inotify events, so that drawing it makes no syscalls. Hidden entries are
+// left out; a ".." row above the entries leads up.
+typedef struct dirEntry { char *name; int is_dir; } dirEntry;
+typedef struct dirLoad {
+  char *path; dirEntry *e; int n, error;
+  char *select;                // Entry to select once loaded
+  pthread_t tid;
+} dirLoad;
+typedef struct dirModel {
+  char *path;                  // Absolute path of the directory shown
+  dirEntry *e; int n, cap;
+  int selected, scroll;        // Rows, counting ".." if shown
+  int focus;                   // Keys go to the sidebar
+  dirLoad *load;               // Running load; events wait until it lands
+  int ifd, wd;                 // inotify watch on path
+} dirModel;
 
 struct editorConfig {
   int cx, cy; int rx; int rowoff; int coloff; int screenrows; int screencols;
-  int numrows; erow *row; int dirty; char *filename; char statusmsg[80];
+  int numrows; rowNode *rows; int dirty; char *filename; char statusmsg[80];
   time_t statusmsg_time; struct editorSyntax *syntax; struct termios orig_termios;
   int sidebar_visible; int editor_width; int selection_active;
   int sel_start_cy, sel_start_cx; int sel_end_cy, sel_end_cx;
-  undoState *undo_head;
-  undoState *undo_current;
-  int undo_count;
+  undoChunk *undo_first, *undo_last;
+  undoChunk *undo_chunk; size_t undo_pos;  // Records before here are applied
+  size_t undo_bytes;
+  int undo_open;  // The last record may still be extended
+  int undo_reload;  // Records go into a reload (editorReloadDiff)
   int in_undo;  // Flag to prevent recording undo during undo/redo
+  char *map; size_t map_size;  // Mapped file backing unmaterialized spans
+  size_t map_avail; ino_t map_ino;  // How much of it the file still has
+  size_t *line_off;            // Line start offsets into map
+  int large, view;             // Large-file mode; not edited yet
+  erow *view_rows; int *view_src;  // Lines drawn from the map (editorViewRow)
+  int hl_valid;                // Rows [0, hl_valid) have settled end states
+  erow *lru_head, *lru_tail; int lru_count;
+  // Frames are drawn into back and diffed against front, the frame the
+  // terminal shows. pen_* is where drawing goes next, term_* where the
+  // terminal cursor and colours are (-1 when unknown).
+  screenCell *front, *back; int grid_rows, grid_cols;
+  int pen_y, pen_x, pen_fg, pen_bg;
+  int term_y, term_x, term_fg, term_bg;
+  const char *sgr[SCREEN_STYLES]; int nsgr;
+  int frame_bytes; long long total_bytes; int frames;
+  int frame_pending; double frame_time;  // A frame is due; when the last was drawn
+  findState find;
+  inputState in;
+  journal journal;
+  saveJob *save; unsigned save_gen;  // The save running, if any
+  size_t remap_size; long long remap_changes;  // A saved file to map (editorRemap)
+  long long changes;                 // Changes to the rows so far
+  // The file as last opened, saved or followed, to tell outside changes by.
+  off_t file_size; struct timespec file_mtime; ino_t file_ino;
+  double disk_checked;         // When the file was last checked
+  int disk_warned, disk_overwrite;  // Outside changes reported; Ctrl-S overwrites
+  follow follow;
+  dirModel dir;
 };
 struct editorConfig E;
+// Search workers read the row store under a read lock, a job at a time.
+// Scans only run while the search prompt is up, when the one change to the
+// tree is editorRow cutting a line out of a span, done under the write lock.
+// Writers are preferred so a busy scan never stalls the screen for long.
+pthread_rwlock_t rows_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+// journal_lock guards the journal's buffer and path; the writer holds
+// journal_io while it writes, taken after journal_lock.
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t journal_io = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_wake = PTHREAD_COND_INITIALIZER;
 char DYNAMIC_COLOR_STATUS_BG[32];
 char DYNAMIC_COLOR_STATUS_FG_ARROW[32];
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
@@ -110,21 +357,26 @@ char *C_HL_keywords[] = {
     NULL};
 struct editorSyntax HLDB[] = {
     {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL},
 };
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorIdle();
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allow_empty);
 void editorMoveCursor(int key);
 void editorClearSelection();
 void editorStartOrExtendSelection(int key);
+void editorUpdateRow(erow *row);
+int editorCheckDisk();
+void editorMapCut(struct stat *st);
 
 // Undo system forward declarations
-void undoPush(enum undoType type, int cy, int cx, char c, char *text, int text_len);
-void undoFreeState(undoState *state);
+void undoPush(enum undoType type, int cy, int cx, const char *text, int len);
 void editorUndo();
 void editorRedo();
+void editorEndView();
+int editorCutShort();
 
 void die(const char *s) {
   write(STDOUT_FILENO, "\x1b[2J", 4);
@@ -133,6 +385,7 @@ void die(const char *s) {
   exit(1);
 }
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -145,82 +398,210 @@ void enableRawMode() {
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);  // Bracketed paste
 }
-int editorReadKey() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
-  }
-  if (c == '\x1b') {
-    char seq[5];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        } else if (seq[2] == ';') {
-          if (read(STDIN_FILENO, &seq[3], 1) != 1) return '\x1b';
-          if (read(STDIN_FILENO, &seq[4], 1) != 1) return '\x1b';
-          if (seq[1] == '1') {
-            switch(seq[3]) {
-              case '2': // Shift
-                switch (seq[4]) {
-                  case 'H': return SHIFT_HOME_KEY;
-                  case 'F': return SHIFT_END_KEY;
-                  case 'A': return SHIFT_ARROW_UP; case 'B': return SHIFT_ARROW_DOWN;
-                  case 'C': return SHIFT_ARROW_RIGHT; case 'D': return SHIFT_ARROW_LEFT;
-                }
-                break;
-              case '5': // Ctrl
-                switch (seq[4]) {
-                  case 'A': return CTRL_ARROW_UP; case 'B': return CTRL_ARROW_DOWN;
-                  case 'C': return CTRL_ARROW_RIGHT; case 'D': return CTRL_ARROW_LEFT;
-                }
-                break;
-              case '6': // Ctrl + Shift
-                switch (seq[4]) {
-                  case 'C': return CTRL_SHIFT_ARROW_RIGHT;
-                  case 'D': return CTRL_SHIFT_ARROW_LEFT;
-                }
-                break;
-            }
-          }
-        }
-      } else {
-        switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return HOME_KEY;
-          case 'F': return END_KEY;
-        }
+// Escape sequences the terminal sends for keys, after the ESC.
+struct escapeKey { const char *seq; int key; } escapeKeys[] = {
+  {"[A", ARROW_UP}, {"[B", ARROW_DOWN}, {"[C", ARROW_RIGHT}, {"[D", ARROW_LEFT},
+  {"[H", HOME_KEY}, {"[F", END_KEY}, {"OH", HOME_KEY}, {"OF", END_KEY},
+  {"Oc", CTRL_ARROW_RIGHT}, {"Od", CTRL_ARROW_LEFT},
+  {"[1~", HOME_KEY}, {"[7~", HOME_KEY}, {"[4~", END_KEY}, {"[8~", END_KEY},
+  {"[3~", DEL_KEY}, {"[5~", PAGE_UP}, {"[6~", PAGE_DOWN},
+  {"[1;2H", SHIFT_HOME_KEY}, {"[1;2F", SHIFT_END_KEY},
+  {"[1;2A", SHIFT_ARROW_UP}, {"[1;2B", SHIFT_ARROW_DOWN},
+  {"[1;2C", SHIFT_ARROW_RIGHT}, {"[1;2D", SHIFT_ARROW_LEFT},
+  {"[1;5A", CTRL_ARROW_UP}, {"[1;5B", CTRL_ARROW_DOWN},
+  {"[1;5C", CTRL_ARROW_RIGHT}, {"[1;5D", CTRL_ARROW_LEFT},
+  {"[1;6C", CTRL_SHIFT_ARROW_RIGHT}, {"[1;6D", CTRL_SHIFT_ARROW_LEFT},
+  {"[200~", PASTE_START}, {"[201~", PASTE_END},
+};
+// Compile escapeKeys into the input state machine, state 0 being right
+// after an ESC.
+void inputCompileKeys() {
+  inputState *in = &E.in;
+  in->nstates = 1;
+  for (size_t j = 0; j < sizeof(escapeKeys) / sizeof(escapeKeys[0]); j++) {
+    int state = 0;
+    for (const char *p = escapeKeys[j].seq; *p; p++) {
+      if (!in->next[state][(int)*p]) {
+        if (in->nstates == INPUT_STATES) die("escapeKeys");
+        in->next[state][(int)*p] = in->nstates++;
       }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
-        case 'c': return CTRL_ARROW_RIGHT; 
-        case 'd': return CTRL_ARROW_LEFT;
+      state = in->next[state][(int)*p];
+    }
+    in->key[state] = escapeKeys[j].key;
+  }
+}
+int inputByte(unsigned i) { return E.in.ring[(E.in.head + i) % INPUT_RING]; }
+// Read whatever input is waiting into the free part of the ring, without
+// blocking. Returns the number of bytes read.
+int inputFill() {
+  inputState *in = &E.in;
+  unsigned at = in->tail % INPUT_RING, space = INPUT_RING - (in->tail - in->head);
+  if (!space) return 0;
+  unsigned first = INPUT_RING - at < space ? INPUT_RING - at : space;
+  struct iovec iov[2] = { { &in->ring[at], first }, { in->ring, space - first } };
+  ssize_t n = readv(STDIN_FILENO, iov, 2);
+  if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+  if (n <= 0) return 0;
+  in->tail += n;
+  return n;
+}
+// Decode buffered input into the key queue until either runs out or a
+// paste starts, whose text editorReadPaste takes straight from the ring.
+// A sequence cut short by the end of the input is left for the next read,
+// unless flush is set: then its ESC is the Escape key. Unknown CSI
+// sequences are dropped whole.
+void inputDecode(int flush) {
+  inputState *in = &E.in;
+  if (!in->nstates) inputCompileKeys();
+  while (in->head != in->tail && in->key_tail - in->key_head < INPUT_KEYS) {
+    int key = inputByte(0), len = 1, n = in->tail - in->head;
+    if (key == '\x1b') {
+      int state = 0, c;
+      for (; len < n; len++) {
+        c = inputByte(len);
+        state = c < 128 ? in->next[state][c] : 0;
+        if (!state || in->key[state]) break;
+      }
+      if (len < n && state) {
+        key = in->key[state]; len++;
+      } else if (len < n && inputByte(1) == '[') {
+        while (len < n && (inputByte(len) < 0x40 || inputByte(len) > 0x7e)) len++;
+        if (len < n) key = 0, len++;
+        else if (!flush) return;
+        else len = 1;
+      } else if (len == n && !flush) {
+        return;
+      } else {
+        len = 1;
       }
     }
-    return '\x1b';
-  } else {
-    return c;
+    if (key == 8) key = BACKSPACE;  // Ctrl-H, what some terminals send for it
+    in->head += len;
+    if (key) in->keys[in->key_tail++ % INPUT_KEYS] = key;
+    if (key == PASTE_START) return;
+  }
+}
+// Read a bracketed paste up to its closing ESC[201~ in large reads. The
+// terminal sends newlines as '\r' or "\r\n"; they come back as '\n'.
+char *editorReadPaste(int *len) {
+  static const char end[] = "\x1b[201~";
+  inputState *in = &E.in;
+  size_t cap = 2 * INPUT_RING, n = 0, scanned = 0;
+  char *buf = malloc(cap), *mark = NULL;
+  for (; in->head != in->tail; n++) buf[n] = inputByte(0), in->head++;
+  while (!(mark = memmem(&buf[scanned], n - scanned, end, 6))) {
+    scanned = n > 5 ? n - 5 : 0;
+    if (cap - n < INPUT_RING) { cap *= 2; buf = realloc(buf, cap); }
+    ssize_t got = read(STDIN_FILENO, &buf[n], INPUT_RING);
+    if (got == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (got > 0) n += got;
+  }
+  // Keys typed after the paste go back into the ring, which is empty now
+  // and holds at least a read's worth.
+  size_t after = &buf[n] - (mark + 6);
+  memcpy(in->ring, mark + 6, after);
+  in->head = 0; in->tail = after;
+  char *w = buf;
+  for (char *r = buf; r < mark; r++) {
+    if (*r == '\r' && r + 1 < mark && r[1] == '\n') continue;
+    *w++ = *r == '\r' ? '\n' : *r;
+  }
+  *len = w - buf;
+  return buf;
+}
+double editorNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+int winch_wake[2] = {-1, -1};  // The SIGWINCH handler writes a byte here
+void editorWinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  if (write(winch_wake[1], "", 1) == -1) { /* pipe full: a wakeup is pending */ }
+  errno = saved;
+}
+// A mapped file can be cut short under us (logrotate's copytruncate, say),
+// and reading past its new end raises SIGBUS. Code reading the map points
+// map_guard at a sigsetjmp buffer first; a fault jumps back there and the
+// read gives up, and the event loop has the file checked (editorMapCut).
+// A fault with no read armed gets the default action.
+volatile sig_atomic_t map_fault;
+__thread sigjmp_buf *map_guard;
+void editorMapFault(int sig) {
+  if (map_guard) { map_fault = 1; siglongjmp(*map_guard, 1); }
+  struct sigaction dfl = { .sa_handler = SIG_DFL };
+  sigaction(sig, &dfl, NULL);
+}
+void editorResize();
+void editorFindIdle();
+void editorSaveIdle();
+void editorFollowIdle();
+void editorDirIdle();
+void editorDirEvents();
+extern int find_wake[2], save_wake[2], dir_wake[2];
+// The event loop: wait for the next key, sleeping in poll until input, a
+// resize, a search result, save progress, a change to a followed file or
+// to the sidebar's directory arrives. All waiting input is decoded before a
+// requested frame is drawn, and frames are at most FRAME_RATE a second, so
+// keys arriving faster than that are drawn together. With nothing to do,
+// poll sleeps until something happens.
+int editorReadKey() {
+  inputState *in = &E.in;
+  double esc_since = 0;
+  int flush = 0;
+  while (in->key_head == in->key_tail) {
+    // Rows and find results must hold still until the prompt is done.
+    if (map_fault && !E.save && !E.find.nlevels) {
+      map_fault = 0; E.frame_pending = 1;
+      struct stat st;
+      if (E.filename && stat(E.filename, &st) == 0) editorMapCut(&st);
+      if (editorCheckDisk() != 2) editorCutShort();
+    }
+    inputFill();
+    inputDecode(flush);
+    if (in->key_head != in->key_tail) break;
+    double now = editorNow();
+    int timeout = -1;
+    if (E.frame_pending) {
+      double wait = E.frame_time + 1.0 / FRAME_RATE - now;
+      if (wait <= 0) { editorRefreshScreen(); continue; }
+      timeout = wait * 1000 + 1;
+    } else if (E.hl_valid < E.numrows && in->head == in->tail) {
+      editorIdle();
+      if (E.frame_pending) continue;
+      if (E.hl_valid < E.numrows) timeout = 0;  // Stopped by a key or a resize
+    }
+    // A sequence cut short is an Escape key once ESC_TIMEOUT passes.
+    flush = 0;
+    if (in->head != in->tail) {
+      if (!esc_since) esc_since = now;
+      int wait = (esc_since - now) * 1000 + ESC_TIMEOUT;
+      if (wait <= 0) { flush = 1; continue; }
+      if (timeout == -1 || wait < timeout) timeout = wait;
+    }
+    // Follow mode waits while a search or a save needs the rows to hold still.
+    int following = E.follow.ifd != -1 && !E.save && !E.find.nlevels;
+    if (following && E.follow.pending) timeout = 0;
+    struct pollfd pfd[7] = {{ STDIN_FILENO, POLLIN, 0 }, { winch_wake[0], POLLIN, 0 },
+                            { E.find.scan ? find_wake[0] : -1, POLLIN, 0 },
+                            { E.save ? save_wake[0] : -1, POLLIN, 0 },
+                            { following ? E.follow.ifd : -1, POLLIN, 0 },
+                            { E.dir.load ? dir_wake[0] : -1, POLLIN, 0 },
+                            { E.dir.load ? -1 : E.dir.ifd, POLLIN, 0 }};
+    if (poll(pfd, 7, timeout) == -1 && errno != EINTR) die("poll");
+    if (pfd[1].revents & POLLIN) editorResize();
+    if (pfd[2].revents & POLLIN) editorFindIdle();
+    if (pfd[3].revents & POLLIN) editorSaveIdle();
+    if (following && ((pfd[4].revents & POLLIN) || E.follow.pending)) editorFollowIdle();
+    if (pfd[5].revents & POLLIN) editorDirIdle();
+    if (pfd[6].revents & POLLIN) editorDirEvents();
   }
+  return in->keys[in->key_head++ % INPUT_KEYS];
 }
 int getWindowSize(int *rows, int *cols) {
   struct winsize ws;
@@ -232,14 +613,312 @@ int getWindowSize(int *rows, int *cols) {
     return 0;
   }
 }
+// Journal a change to the rows: just a copy into the journal's buffer. The
+// writer is started on the first change.
+void *journalWriter(void *arg);
+void journalPut(char **buf, size_t *used, size_t *cap, journalRecord *r,
+                const void *text, size_t len, const void *more, size_t more_len) {
+  size_t need = *used + sizeof(*r) + len + more_len;
+  if (need > *cap) {
+    while (need > *cap) *cap = *cap ? *cap * 2 : 65536;
+    *buf = realloc(*buf, *cap);
+  }
+  memcpy(*buf + *used, r, sizeof(*r));
+  if (len) memcpy(*buf + *used + sizeof(*r), text, len);
+  if (more_len) memcpy(*buf + *used + sizeof(*r) + len, more, more_len);
+  *used = need;
+}
+void journalLog(enum journalType type, int a, int b, int c,
+                const void *text, size_t len, const void *more, size_t more_len) {
+  journal *j = &E.journal;
+  E.changes++;  // Every change to the rows comes through here
+  if (!j->path) return;
+  journalRecord r = { len + more_len, type, a, b, c };
+  pthread_mutex_lock(&journal_lock);
+  if (!j->len) pthread_cond_signal(&journal_wake);
+  journalPut(&j->buf, &j->len, &j->cap, &r, text, len, more, more_len);
+  if (j->keep_since)
+    journalPut(&j->since, &j->since_len, &j->since_cap, &r, text, len, more, more_len);
+  if (!j->started) {
+    pthread_t tid;
+    j->started = pthread_create(&tid, NULL, journalWriter, NULL) == 0;
+    if (j->started) pthread_detach(tid);
+  }
+  pthread_mutex_unlock(&journal_lock);
+}
+// Row store implementation
+unsigned int rowNodePrio() {
+  static unsigned int seed = 2463534242u;
+  seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+  return seed;
+}
+rowNode *rowNodeNew(int lines, int src) {
+  rowNode *node = calloc(1, sizeof(rowNode));
+  node->prio = rowNodePrio(); node->count = lines;
+  node->lines = lines; node->src = src;
+  node->row.dirty = 1; node->row.hl_start = -1;
+  node->row.hl_stale = node->stale = src < 0;
+  node->gen = E.save_gen;
+  return node;
+}
+// Keep a block the running save still reads, to free when it is over.
+void saveKeep(saveJob *s, void *p) {
+  if (s->nkept == s->kept_cap) {
+    s->kept_cap = s->kept_cap ? s->kept_cap * 2 : 64;
+    s->kept = realloc(s->kept, sizeof(void *) * s->kept_cap);
+  }
+  s->kept[s->nkept++] = p;
+}
+int rowNodeShared(rowNode *t) { return E.save && t->gen < E.save->gen; }
+// Copy t, which the running save's snapshot holds, for the tree to change
+// instead. The copy takes t's place among its neighbours, its children and
+// on the LRU list, and its text, which stays the save's until it is over.
+rowNode *rowNodeCopy(rowNode *t) {
+  rowNode *c = malloc(sizeof(rowNode));
+  *c = *t;
+  c->gen = E.save_gen;
+  if (c->row.chars) c->row.shared = E.save->gen;
+  if (c->prev) c->prev->next = c;
+  if (c->next) c->next->prev = c;
+  if (c->left) c->left->parent = c;
+  if (c->right) c->right->parent = c;
+  if (c->row.render) {
+    if (c->row.lru_prev) c->row.lru_prev->lru_next = &c->row; else E.lru_head = &c->row;
+    if (c->row.lru_next) c->row.lru_next->lru_prev = &c->row; else E.lru_tail = &c->row;
+  }
+  saveKeep(E.save, t);
+  return c;
+}
+int rowNodeCount(rowNode *t) { return t ? t->count : 0; }
+void rowNodeUpdate(rowNode *t) {
+  t->count = t->lines + rowNodeCount(t->left) + rowNodeCount(t->right);
+  t->stale = t->row.hl_stale + (t->left ? t->left->stale : 0) +
+             (t->right ? t->right->stale : 0);
+  if (t->left) t->left->parent = t;
+  if (t->right) t->right->parent = t;
+}
+void rowTreeSetRoot(rowNode *root) {
+  E.rows = root;
+  if (root) root->parent = NULL;
+}
+// node, copied if the save holds it; its ancestors are copied first, so the
+// copy can take node's place under its parent.
+rowNode *rowNodeOwn(rowNode *node) {
+  if (!rowNodeShared(node)) return node;
+  rowNode *p = node->parent ? rowNodeOwn(node->parent) : NULL;
+  rowNode *c = rowNodeCopy(node);
+  if (!p) rowTreeSetRoot(c);
+  else if (p->left == node) p->left = c;
+  else p->right = c;
+  return c;
+}
+rowNode *rowTreeMerge(rowNode *l, rowNode *r) {
+  if (!l) return r;
+  if (!r) return l;
+  if (l->prio > r->prio) {
+    if (rowNodeShared(l)) l = rowNodeCopy(l);
+    l->right = rowTreeMerge(l->right, r); rowNodeUpdate(l); return l;
+  }
+  if (rowNodeShared(r)) r = rowNodeCopy(r);
+  r->left = rowTreeMerge(l, r->left); rowNodeUpdate(r); return r;
+}
+// Split t so that its first k lines end up in *l and the rest in *r. When k
+// falls inside a span the span is cut in two, the tail becoming a new node.
+void rowTreeSplit(rowNode *t, int k, rowNode **l, rowNode **r) {
+  if (!t) { *l = *r = NULL; return; }
+  if (rowNodeShared(t)) t = rowNodeCopy(t);
+  int lc = rowNodeCount(t->left);
+  if (k <= lc) {
+    rowTreeSplit(t->left, k, l, &t->left);
+    *r = t;
+  } else if (k >= lc + t->lines) {
+    rowTreeSplit(t->right, k - lc - t->lines, &t->right, r);
+    *l = t;
+  } else {
+    int keep = k - lc;
+    rowNode *tail = rowNodeNew(t->lines - keep, t->src + keep);
+    t->lines = keep;
+    tail->prev = t; tail->next = t->next;
+    if (t->next) t->next->prev = tail;
+    t->next = tail;
+    *r = rowTreeMerge(tail, t->right);
+    t->right = NULL;
+    *l = t;
+  }
+  rowNodeUpdate(t);
+}
+// Return the node holding line `at`; *off is the line's offset within it.
+rowNode *rowTreeAt(int at, int *off) {
+  rowNode *t = E.rows;
+  while (t) {
+    int lc = rowNodeCount(t->left);
+    if (at < lc) t = t->left;
+    else if (at < lc + t->lines) { if (off) *off = at - lc; return t; }
+    else { at -= lc + t->lines; t = t->right; }
+  }
+  return NULL;
+}
+// Line number of the first line held by node, walking up through parents.
+int rowIndex(rowNode *node) {
+  int at = rowNodeCount(node->left);
+  for (; node->parent; node = node->parent) {
+    if (node == node->parent->right)
+      at += rowNodeCount(node->parent->left) + node->parent->lines;
+  }
+  return at;
+}
+// First stale row at or after line `from` in t, whose first line is line
+// `base`; -1 if there is none.
+int rowTreeNextStale(rowNode *t, int base, int from) {
+  if (!t || !t->stale || base + t->count <= from) return -1;
+  int at = rowTreeNextStale(t->left, base, from);
+  if (at >= 0) return at;
+  at = base + rowNodeCount(t->left);
+  if (t->row.hl_stale && at >= from) return at;
+  return rowTreeNextStale(t->right, at + t->lines, from);
+}
+void rowNodeSetStale(rowNode *node, int stale) {
+  if (node->row.hl_stale == stale) return;
+  node->row.hl_stale = stale;
+  for (; node; node = node->parent) node->stale += stale ? 1 : -1;
+}
+int rowTreeRecount(rowNode *t) {
+  if (!t) return 0;
+  rowTreeRecount(t->left); rowTreeRecount(t->right);
+  rowNodeUpdate(t);
+  return t->count;
+}
+// Build a treap in O(n) over n nodes already threaded in order through next,
+// keeping the right spine on a stack as in a Cartesian tree construction.
+rowNode *rowTreeBuild(rowNode *first, int n) {
+  rowNode **spine = malloc(sizeof(rowNode *) * (n + 1));
+  int top = 0;
+  for (rowNode *node = first; node; node = node->next) {
+    rowNode *last = NULL;
+    while (top && spine[top - 1]->prio < node->prio) last = spine[--top];
+    node->left = last; node->right = NULL;
+    if (top) spine[top - 1]->right = node;
+    spine[top++] = node;
+  }
+  rowNode *root = top ? spine[0] : NULL;
+  free(spine);
+  rowTreeRecount(root);
+  if (root) root->parent = NULL;
+  return root;
+}
+rowNode *rowTreeFirst() {
+  rowNode *t = E.rows;
+  while (t && t->left) t = t->left;
+  return t;
+}
+void rowTreeFree(rowNode *t) {
+  if (!t) return;
+  rowTreeFree(t->left); rowTreeFree(t->right);
+  free(t->row.render); free(t->row.chars); free(t->row.hl); free(t);
+  E.lru_head = E.lru_tail = NULL; E.lru_count = 0;
+}
+// Text of line `line` of the mmapped file, without its line terminator.
+// Lines the file no longer has are cut short or empty (see editorMapCut);
+// the text is read under map_guard, as with editorMapCopy.
+char *editorMappedLine(int line, int *len) {
+  size_t start = E.line_off[line], end = E.line_off[line + 1] - 1;
+  if (end > E.map_avail) end = E.map_avail;
+  if (start > end) start = end;
+  sigjmp_buf jb, *outer = map_guard;
+  if (sigsetjmp(jb, 0)) { map_guard = outer; *len = 0; return &E.map[start]; }
+  map_guard = &jb;
+  while (end > start && E.map[end - 1] == '\r') end--;
+  map_guard = outer;
+  *len = end - start;
+  return &E.map[start];
+}
+// Copy len bytes of mapped text; zeros where the file was cut short under
+// them, which leaves the buffer read-only anyway (editorCutShort).
+void editorMapCopy(char *dst, const char *src, size_t len) {
+  sigjmp_buf jb, *outer = map_guard;
+  if (sigsetjmp(jb, 0)) { map_guard = outer; memset(dst, 0, len); return; }
+  map_guard = &jb;
+  memcpy(dst, src, len);
+  map_guard = outer;
+}
+erow *editorViewRow(int src);
+erow *editorRow(int at) {
+  if (at < 0 || at >= E.numrows) return NULL;
+  int off; rowNode *node = rowTreeAt(at, &off);
+  if (node->src < 0 && !rowNodeShared(node)) return &node->row;
+  if (E.view && node->src >= 0) return editorViewRow(node->src + off);
+  pthread_rwlock_wrlock(&rows_lock);
+  if (node->src < 0) {
+    node = rowNodeOwn(node);
+    pthread_rwlock_unlock(&rows_lock);
+    return &node->row;
+  }
+  rowNode *l, *r;
+  rowTreeSplit(E.rows, at, &l, &r);
+  rowTreeSplit(r, 1, &node, &r);
+  rowTreeSetRoot(rowTreeMerge(rowTreeMerge(l, node), r));
+  int len; char *text = editorMappedLine(node->src, &len);
+  erow *row = &node->row;
+  row->size = len;
+  row->chars = malloc(len + 1);
+  editorMapCopy(row->chars, text, len);
+  row->chars[len] = '\0'; row->shared = 0;
+  node->src = -1;
+  pthread_rwlock_unlock(&rows_lock);
+  editorUpdateRow(row);
+  return row;
+}
 int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-  if (E.syntax == NULL) return;
-  char **keywords = E.syntax->keywords;
+// Compile a keyword list into a trie; a trailing '|' marks a KEYWORD2.
+keywordTrie *editorCompileKeywords(char **keywords) {
+  keywordTrie *t = calloc(1, sizeof(keywordTrie));
+  int chars = 0;
+  t->width = 1;
+  for (int j = 0; keywords[j]; j++) {
+    for (char *p = keywords[j]; *p; p++) {
+      unsigned char c = *p;
+      if (c == '|' && p[1] == '\0') break;
+      if (!t->cls[c]) t->cls[c] = t->width++;
+      chars++;
+    }
+  }
+  t->next = calloc((chars + 1) * t->width, sizeof(short));
+  t->hl = calloc(chars + 1, 1);
+  t->rank = calloc(chars + 1, sizeof(short));
+  int nodes = 1;
+  for (int j = 0; keywords[j]; j++) {
+    int klen = strlen(keywords[j]), node = 0;
+    int kw2 = klen && keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+    if (klen == 0) continue;
+    for (int k = 0; k < klen; k++) {
+      short *child = &t->next[node * t->width + t->cls[(unsigned char)keywords[j][k]]];
+      if (!*child) *child = nodes++;
+      node = *child;
+    }
+    // As with the linear scan this replaces, the first listing wins.
+    if (!t->hl[node]) { t->hl[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1; t->rank[node] = j; }
+  }
+  return t;
+}
+// Highlight text[0..len) (NUL-terminated) into hl, starting inside a
+// multi-line comment if in_comment. Returns whether a comment is still open
+// at the end. With hl == NULL only that end state is wanted; tabs do not
+// change it, so callers may pass chars instead of render.
+int editorHighlightText(const char *text, int len, int in_comment, unsigned char *hl) {
+  static unsigned char *scratch = NULL; static int scratch_len = 0;
+  if (hl == NULL) {
+    if (!scratch || len > scratch_len) {
+      scratch_len = len > 256 ? len : 256;
+      scratch = realloc(scratch, scratch_len);
+    }
+    hl = scratch;
+  }
+  memset(hl, HL_NORMAL, len);
+  if (E.syntax == NULL) return 0;
+  keywordTrie *trie = E.syntax->trie;
   char *scs = E.syntax->singleline_comment_start;
   char *mcs = E.syntax->multiline_comment_start;
   char *mce = E.syntax->multiline_comment_end;
@@ -248,70 +927,68 @@ void editorUpdateSyntax(erow *row) {
   int mce_len = mce ? strlen(mce) : 0;
   int prev_sep = 1;
   int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
   int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+  while (i < len) {
+    char c = text[i];
+    unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
     if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+      if (!strncmp(&text[i], scs, scs_len)) {
+        memset(&hl[i], HL_COMMENT, len - i);
         break;
       }
     }
     if (mcs_len && mce_len && !in_string) {
       if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+        hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&text[i], mce, mce_len)) {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
           i += mce_len; in_comment = 0; prev_sep = 1;
           continue;
         } else { i++; continue; }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+      } else if (!strncmp(&text[i], mcs, mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
         i += mcs_len; in_comment = 1; continue;
       }
     }
     if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
       if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING; i += 2; continue;
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < len) {
+          hl[i + 1] = HL_STRING; i += 2; continue;
         }
         if (c == in_string) in_string = 0;
         i++; prev_sep = 1; continue;
       } else {
         if (c == '"' || c == '\'') {
-          in_string = c; row->hl[i] = HL_STRING; i++; continue;
+          in_string = c; hl[i] = HL_STRING; i++; continue;
         }
       }
     }
     if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
       if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER; i++; prev_sep = 0; continue;
+        hl[i] = HL_NUMBER; i++; prev_sep = 0; continue;
       }
     }
     if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen; break;
+      // Walk the trie along the token; of the keywords ending at a
+      // separator, the one listed first wins. Byte 0 has no column, so the
+      // walk stops at the terminating NUL.
+      int klen = 0, kw = 0, rank = 0, node = 0;
+      for (int k = i; (node = trie->next[node * trie->width + trie->cls[(unsigned char)text[k]]]); k++) {
+        if (trie->hl[node] && (!kw || trie->rank[node] < rank) && is_separator(text[k + 1])) {
+          klen = k + 1 - i; kw = trie->hl[node]; rank = trie->rank[node];
         }
       }
-      if (keywords[j] != NULL) { prev_sep = 0; continue; }
+      if (kw) {
+        memset(&hl[i], kw, klen);
+        i += klen; prev_sep = 0; continue;
+      }
     }
     prev_sep = is_separator(c);
     i++;
   }
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  return in_comment;
 }
 const char *editorSyntaxToAnsiColor(int hl) {
   switch (hl) {
@@ -321,8 +998,19 @@ const char *editorSyntaxToAnsiColor(int hl) {
   case HL_MATCH: return COLOR_MATCH; default: return COLOR_FG;
   }
 }
+// The grammar changed: every cached highlight and lexed state is stale.
+void editorViewReset();
+void editorRehighlightAll() {
+  E.hl_valid = 0;
+  editorViewReset();
+  for (erow *row = E.lru_head; row; row = row->lru_next) row->dirty = 1;
+  for (rowNode *node = rowTreeFirst(); node; node = node->next)
+    node->row.hl_stale = node->src < 0;
+  rowTreeRecount(E.rows);
+}
 void editorSelectSyntaxHighlight() {
   E.syntax = NULL;
+  editorRehighlightAll();
   if (E.filename == NULL) return;
   char *ext = strrchr(E.filename, '.');
   for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
@@ -332,10 +1020,8 @@ void editorSelectSyntaxHighlight() {
       int is_ext = (s->filematch[i][0] == '.');
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
           (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        if (!s->trie) s->trie = editorCompileKeywords(s->keywords);
         E.syntax = s;
-        for (int filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
         return;
       }
       i++;
@@ -360,7 +1046,78 @@ int editorRowRxToCx(erow *row, int rx) {
   }
   return cx;
 }
+// The row's text changed: its caches and its lexed end state are stale.
 void editorUpdateRow(erow *row) {
+  row->dirty = 1;
+  rowNodeSetStale((rowNode *)row, 1);
+  int at = rowIndex((rowNode *)row);
+  if (at < E.hl_valid) E.hl_valid = at;
+}
+void editorLruUnlink(erow *row) {
+  if (row->lru_prev) row->lru_prev->lru_next = row->lru_next;
+  else E.lru_head = row->lru_next;
+  if (row->lru_next) row->lru_next->lru_prev = row->lru_prev;
+  else E.lru_tail = row->lru_prev;
+  row->lru_prev = row->lru_next = NULL;
+  E.lru_count--;
+}
+void editorRowDropCache(erow *row) {
+  if (!row->render) return;
+  editorLruUnlink(row);
+  free(row->render); free(row->hl);
+  row->render = NULL; row->hl = NULL; row->rsize = 0;
+  row->dirty = 1;
+}
+// Move a row holding caches to the front of the LRU list, evicting the
+// coldest rows once more than RENDER_CACHE_ROWS of them hold caches.
+void editorLruTouch(erow *row) {
+  if (E.lru_head == row) return;
+  if (row->lru_prev) editorLruUnlink(row);
+  row->lru_next = E.lru_head;
+  if (E.lru_head) E.lru_head->lru_prev = row; else E.lru_tail = row;
+  E.lru_head = row; E.lru_count++;
+  while (E.lru_count > RENDER_CACHE_ROWS) editorRowDropCache(E.lru_tail);
+}
+// Lexer state at the start of a row: the end state of the row before it.
+// Unmaterialized spans are not lexed and end outside any comment.
+int editorRowStartState(rowNode *node, int off) {
+  if (off || !node->prev || node->prev->src >= 0) return 0;
+  return node->prev->row.hl_open_comment;
+}
+// Settle end states forward from hl_valid until rows [0, upto) are done or
+// budget rows have been lexed. A row whose text is unchanged and that starts
+// from its checkpointed state still ends in its checkpointed state, so once
+// the states converge the frontier jumps straight to the next stale row.
+void editorSyntaxAdvance(int upto, int budget) {
+  if (upto > E.numrows) upto = E.numrows;
+  int at = E.hl_valid, off = 0;
+  if (at >= upto) return;
+  rowNode *node = rowTreeAt(at, &off);
+  int state = editorRowStartState(node, off);
+  while (node && at < upto && budget > 0) {
+    erow *row = &node->row;
+    if (node->src >= 0) {
+      at += node->lines - off; state = 0;
+    } else if (!row->hl_stale && row->hl_start == state) {
+      at = rowTreeNextStale(E.rows, 0, at);
+      if (at < 0) { at = E.numrows; break; }
+      node = rowTreeAt(at, &off);
+      state = editorRowStartState(node, off);
+      continue;
+    } else {
+      if (row->hl_start != state) row->dirty = 1;
+      row->hl_start = state;
+      state = row->hl_open_comment =
+          editorHighlightText(row->chars, row->size, state, NULL);
+      rowNodeSetStale(node, 0);
+      at++; budget--;
+    }
+    node = node->next; off = 0;
+  }
+  E.hl_valid = at;
+}
+// Build the row's render and hl caches, lexing from state start.
+void editorRowFillCache(erow *row, int start) {
   int tabs = 0;
   for (int j = 0; j < row->size; j++) if (row->chars[j] == '\t') tabs++;
   free(row->render);
@@ -376,486 +1133,634 @@ void editorUpdateRow(erow *row) {
   }
   row->render[idx] = '\0';
   row->rsize = idx;
-  editorUpdateSyntax(row);
+  row->hl = realloc(row->hl, row->rsize + 1);
+  row->hl_start = start;
+  row->hl_open_comment = editorHighlightText(row->render, row->rsize, start, row->hl);
+  row->dirty = 0;
+}
+// In large-file mode a line still in a span is drawn straight from the
+// map: it is rendered into one of VIEW_ROWS slots, picked by its line in
+// the file, instead of being materialized, and highlighted on its own.
+// Until the first edit the cursor reads its rows from there too, so paging
+// through the file takes no memory beyond the slots.
+erow *editorViewRow(int src) {
+  if (!E.view_rows) {
+    E.view_rows = calloc(VIEW_ROWS, sizeof(erow));
+    E.view_src = malloc(sizeof(int) * VIEW_ROWS);
+    for (int j = 0; j < VIEW_ROWS; j++) E.view_src[j] = -1;
+  }
+  int slot = src & (VIEW_ROWS - 1);
+  erow *row = &E.view_rows[slot];
+  if (E.view_src[slot] == src && !row->dirty) return row;
+  int len; char *text = editorMappedLine(src, &len);
+  row->chars = realloc(row->chars, len + 1);
+  editorMapCopy(row->chars, text, len);
+  row->chars[len] = '\0';
+  row->size = len;
+  editorRowFillCache(row, 0);
+  E.view_src[slot] = src;
+  return row;
+}
+// Forget the rendered slots, as the map or the grammar changed.
+void editorViewReset() {
+  if (E.view_src) for (int j = 0; j < VIEW_ROWS; j++) E.view_src[j] = -1;
+}
+// Return row `at` with its render and hl caches up to date. Past hl_valid
+// the start state is not settled yet, so the row is highlighted from its
+// last checkpoint and redone once editorSyntaxAdvance gets there.
+erow *editorRenderRow(int at) {
+  if (E.large && at >= 0 && at < E.numrows) {
+    int off; rowNode *node = rowTreeAt(at, &off);
+    if (node->src >= 0) return editorViewRow(node->src + off);
+  }
+  erow *row = editorRow(at);
+  if (!row) return NULL;
+  int start = (at > E.hl_valid && row->hl_start >= 0) ? row->hl_start
+      : editorRowStartState((rowNode *)row, 0);
+  if (!row->dirty && row->hl_start == start) { editorLruTouch(row); return row; }
+  editorRowFillCache(row, start);
+  if (E.hl_valid == at) { rowNodeSetStale((rowNode *)row, 0); E.hl_valid = at + 1; }
+  editorLruTouch(row);
+  return row;
 }
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E.numrows) return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-  E.row[at].idx = at; E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-  E.row[at].rsize = 0; E.row[at].render = NULL; E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
-  E.numrows++; 
+  rowNode *node = rowNodeNew(1, -1), *l, *r;
+  rowTreeSplit(E.rows, at, &l, &r);
+  rowNode *before = l, *after = r;
+  while (before && before->right) before = before->right;
+  while (after && after->left) after = after->left;
+  node->prev = before; node->next = after;
+  if (before) before->next = node;
+  if (after) after->prev = node;
+  rowTreeSetRoot(rowTreeMerge(rowTreeMerge(l, node), r));
+  E.numrows++;
+  erow *row = &node->row;
+  row->size = len;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  editorUpdateRow(row);
+  journalLog(J_INSERT_ROW, at, 0, 0, s, len, NULL, 0);
   if (!E.in_undo) E.dirty++;
 }
-void editorFreeRow(erow *row) {
-  free(row->render); free(row->chars); free(row->hl);
-}
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--; 
+// Insert the lines of text, split by '\n', as new rows starting at `at`.
+// The rows are built into a treap of their own and merged in with a single
+// split, so n lines cost O(n + log numrows).
+void editorInsertLines(int at, const char *text, int len) {
+  if (at < 0 || at > E.numrows) return;
+  rowNode *first = NULL, *last = NULL, *l, *r;
+  int n = 0;
+  for (const char *p = text, *end = text + len, *q; ; p = q + 1) {
+    if (!(q = memchr(p, '\n', end - p))) q = end;
+    rowNode *node = rowNodeNew(1, -1);
+    node->row.size = q - p;
+    node->row.chars = malloc(q - p + 1);
+    memcpy(node->row.chars, p, q - p);
+    node->row.chars[q - p] = '\0';
+    node->prev = last;
+    if (last) last->next = node; else first = node;
+    last = node; n++;
+    if (q == end) break;
+  }
+  rowNode *lines = rowTreeBuild(first, n);
+  rowTreeSplit(E.rows, at, &l, &r);
+  rowNode *before = l, *after = r;
+  while (before && before->right) before = before->right;
+  while (after && after->left) after = after->left;
+  first->prev = before; last->next = after;
+  if (before) before->next = first;
+  if (after) after->prev = last;
+  rowTreeSetRoot(rowTreeMerge(rowTreeMerge(l, lines), r));
+  E.numrows += n;
+  if (at < E.hl_valid) E.hl_valid = at;
+  journalLog(J_INSERT_LINES, at, 0, 0, text, len, NULL, 0);
   if (!E.in_undo) E.dirty++;
 }
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++; row->chars[at] = c;
-  editorUpdateRow(row); 
+// Row text a running save still has to write out is kept for it instead.
+void editorFreeChars(erow *row) {
+  if (!E.save || row->shared != E.save->gen) free(row->chars);
+  else saveKeep(E.save, row->chars);
+}
+// Before changing a row's text in place, copy it if a save is writing it.
+void editorRowUnshare(erow *row) {
+  if (!E.save || row->shared != E.save->gen) return;
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size + 1);
+  editorFreeChars(row);
+  row->chars = chars; row->shared = 0;
+}
+void editorFreeRow(erow *row) {
+  editorRowDropCache(row); editorFreeChars(row);
+}
+// Free a node cut out of the tree, or keep it and its text for the save.
+void rowNodeFree(rowNode *node) {
+  if (!rowNodeShared(node)) { editorFreeRow(&node->row); free(node); return; }
+  editorRowDropCache(&node->row);
+  if (node->row.chars) saveKeep(E.save, node->row.chars);
+  saveKeep(E.save, node);
+}
+// Remove rows [at, at + n) with a single pair of splits.
+void editorDelRows(int at, int n) {
+  if (at < 0 || n <= 0 || at + n > E.numrows) return;
+  rowNode *l, *mid, *r;
+  rowTreeSplit(E.rows, at, &l, &r);
+  rowTreeSplit(r, n, &mid, &r);
+  rowTreeSetRoot(rowTreeMerge(l, r));
+  rowNode *node = mid;
+  while (node->left) node = node->left;
+  rowNode *before = node->prev;
+  for (int left = n; left > 0;) {
+    rowNode *next = node->next;
+    left -= node->lines;
+    rowNodeFree(node);
+    node = next;
+  }
+  if (before) before->next = node;
+  if (node) node->prev = before;
+  // The row now at `at` follows a different row: lex it again.
+  if (node && node->src < 0) rowNodeSetStale(node, 1);
+  E.numrows -= n;
+  if (at < E.hl_valid) E.hl_valid = at;
+  journalLog(J_DEL_ROWS, at, n, 0, NULL, 0, NULL, 0);
   if (!E.in_undo) E.dirty++;
 }
-void editorRowAppendString(erow *row, char *s, size_t len) {
+void editorRowInsertChars(erow *row, int at, const char *s, int len) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowUnshare(row);
   row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len; row->chars[row->size] = '\0';
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
   editorUpdateRow(row); 
+  journalLog(J_ROW_INSERT, rowIndex((rowNode *)row), at, 0, s, len, NULL, 0);
   if (!E.in_undo) E.dirty++;
 }
-void editorRowDelChar(erow *row, int at) {
+void editorRowInsertChar(erow *row, int at, int c) {
+  char ch = c;
+  editorRowInsertChars(row, at, &ch, 1);
+}
+void editorRowDelChars(erow *row, int at, int len) {
   if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--; editorUpdateRow(row); 
+  if (len > row->size - at) len = row->size - at;
+  editorRowUnshare(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len; editorUpdateRow(row); 
+  journalLog(J_ROW_DELETE, rowIndex((rowNode *)row), at, len, NULL, 0, NULL, 0);
   if (!E.in_undo) E.dirty++;
 }
-
-// Undo system implementation
-void undoFreeState(undoState *state) {
-  if (!state) return;
-  if (state->text) free(state->text);
-  if (state->lines) {
-    for (int i = 0; i < state->num_lines; i++) {
-      if (state->lines[i]) free(state->lines[i]);
+void editorRowDelChar(erow *row, int at) { editorRowDelChars(row, at, 1); }
+// Where text inserted at (cy, cx) ends.
+void editorTextEnd(int cy, int cx, const char *text, int len, int *end_cy, int *end_cx) {
+  const char *nl = memrchr(text, '\n', len);
+  *end_cx = nl ? text + len - nl - 1 : cx + len;
+  for (*end_cy = cy; nl; nl = memrchr(text, '\n', nl - text)) (*end_cy)++;
+}
+// Insert len bytes of text, lines split by '\n', at (cy, cx): its first
+// line goes into row cy, the rest become new rows, and what followed cx
+// ends up after the last of them. Every row touched is updated once.
+void editorInsertText(int cy, int cx, const char *text, int len) {
+  if (cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+  erow *row = editorRow(cy);
+  if (!row) return;
+  const char *nl = memchr(text, '\n', len);
+  if (!nl) { editorRowInsertChars(row, cx, text, len); return; }
+  if (cx > row->size) cx = row->size;
+  int end_cy, end_cx;
+  editorTextEnd(cy, cx, text, len, &end_cy, &end_cx);
+  editorInsertLines(cy + 1, nl + 1, text + len - nl - 1);
+  editorRowInsertChars(editorRow(end_cy), end_cx, &row->chars[cx], row->size - cx);
+  editorRowDelChars(row, cx, row->size - cx);
+  editorRowInsertChars(row, cx, text, nl - text);
+}
+// Delete the text from (cy, cx) up to (end_cy, end_cx), joining the two
+// ends and dropping the rows in between with a single pair of splits.
+void editorDeleteRange(int cy, int cx, int end_cy, int end_cx) {
+  if (cy >= E.numrows || end_cy < cy) return;
+  erow *row = editorRow(cy);
+  if (end_cy == cy) { editorRowDelChars(row, cx, end_cx - cx); return; }
+  if (end_cy >= E.numrows) { end_cy = E.numrows - 1; end_cx = editorRow(end_cy)->size; }
+  erow *end = editorRow(end_cy);
+  editorRowDelChars(row, cx, row->size - cx);
+  editorRowInsertChars(row, cx, &end->chars[end_cx], end->size - end_cx);
+  editorDelRows(cy + 1, end_cy - cy);
+}
+// Copy the text from (cy, cx) up to (end_cy, end_cx) into out, lines
+// joined by '\n', and return its length; with out NULL only measure it.
+// Lines are read where they are, so mapped ones are not materialized.
+int editorCopyRange(int cy, int cx, int end_cy, int end_cx, char *out) {
+  int total = 0, off = 0;
+  rowNode *node = rowTreeAt(cy, &off);
+  for (int y = cy; y <= end_cy && node; y++) {
+    int len; const char *text;
+    if (node->src >= 0) text = editorMappedLine(node->src + off, &len);
+    else { text = node->row.chars; len = node->row.size; }
+    int from = y == cy ? cx : 0, to = y == end_cy ? end_cx : len;
+    if (out) {
+      editorMapCopy(&out[total], &text[from], to - from);
+      if (y < end_cy) out[total + to - from] = '\n';
+    }
+    total += to - from + (y < end_cy);
+    if (++off == node->lines) { node = node->next; off = 0; }
+  }
+  return total;
+}
+// Replace the n matches in m, in buffer order and not overlapping, with
+// `with`, building each affected row's new text once.
+void editorReplaceMatches(findMatch *m, int n, const char *with, int wlen) {
+  editorEndView();
+  for (int j = 0; j < n;) {
+    erow *row = editorRow(m[j].row);
+    int end = j, size = row->size, from = 0;
+    for (; end < n && m[end].row == m[j].row; end++) size += wlen - m[end].len;
+    char *chars = malloc(size + 1), *p = chars;
+    for (; j < end; j++) {
+      memcpy(p, &row->chars[from], m[j].col - from); p += m[j].col - from;
+      memcpy(p, with, wlen); p += wlen;
+      from = m[j].col + m[j].len;
     }
-    free(state->lines);
+    memcpy(p, &row->chars[from], row->size - from + 1);
+    editorFreeChars(row);
+    row->chars = chars; row->size = size; row->shared = 0;
+    editorUpdateRow(row);
   }
-  free(state);
+  journalLog(J_REPLACE, n, 0, 0, m, sizeof(findMatch) * n, with, wlen);
+  if (!E.in_undo) E.dirty++;
+}
+
+// Undo system implementation
+#define UNDO_ALIGN(n) (((n) + 7) & ~(size_t)7)
+size_t undoRecordSize(int len, int num_matches) {
+  return UNDO_ALIGN(sizeof(undoRecord) + sizeof(findMatch) * num_matches + len) + 8;
+}
+findMatch *undoMatches(undoRecord *r) { return (findMatch *)(r + 1); }
+char *undoText(undoRecord *r) { return (char *)(undoMatches(r) + r->num_matches); }
+void undoSetSize(undoRecord *r, size_t size) {
+  memcpy((char *)r + size - 8, &size, sizeof(size));
+}
+// The record ending at pos in chunk c, and the chunk and offset it starts at.
+undoRecord *undoBefore(undoChunk *c, size_t pos, undoChunk **chunk, size_t *off) {
+  size_t size;
+  while (c && pos == 0) if ((c = c->prev)) pos = c->used;
+  if (!c) return NULL;
+  memcpy(&size, c->data + pos - 8, sizeof(size));
+  *chunk = c; *off = pos - size;
+  return (undoRecord *)(c->data + pos - size);
+}
+// The last applied record, and the chunk and offset it starts at.
+undoRecord *undoCurrent(undoChunk **chunk, size_t *off) {
+  return undoBefore(E.undo_chunk, E.undo_pos, chunk, off);
+}
+// The first record undone, the one redo applies next.
+undoRecord *undoNext(undoChunk **chunk, size_t *off) {
+  undoChunk *c = E.undo_chunk; size_t pos = E.undo_pos;
+  while (c && pos == c->used) { c = c->next; pos = 0; }
+  if (!c) return NULL;
+  *chunk = c; *off = pos;
+  return (undoRecord *)(c->data + pos);
+}
+void undoFreeChunk(undoChunk *c) {
+  if (c->prev) c->prev->next = c->next; else E.undo_first = c->next;
+  if (c->next) c->next->prev = c->prev; else E.undo_last = c->prev;
+  if (E.undo_chunk == c) { E.undo_chunk = c->prev; E.undo_pos = c->prev ? c->prev->used : 0; }
+  E.undo_bytes -= c->cap;
+  free(c);
 }
 
 void undoClearRedo() {
   // Clear all redo states (everything after current)
-  if (!E.undo_current) return;
-  undoState *next = E.undo_current->next;
-  while (next) {
-    undoState *tmp = next->next;
-    undoFreeState(next);
-    E.undo_count--;
-    next = tmp;
-  }
-  if (E.undo_current) E.undo_current->next = NULL;
+  if (!E.undo_chunk) return;
+  while (E.undo_last != E.undo_chunk) undoFreeChunk(E.undo_last);
+  E.undo_chunk->used = E.undo_pos;
+  if (!E.undo_pos) undoFreeChunk(E.undo_chunk);
 }
 
-void undoPush(enum undoType type, int cy, int cx, char c, char *text, int text_len) {
-  if (E.in_undo) return;  // Don't record undo during undo/redo operations
-  
-  undoState *state = malloc(sizeof(undoState));
-  state->type = type;
-  state->cy = cy;
-  state->cx = cx;
-  state->prev_cy = E.cy;
-  state->prev_cx = E.cx;
-  state->c = c;
-  state->text = NULL;
-  state->text_len = text_len;
-  state->lines = NULL;
-  state->num_lines = 0;
-  state->next = NULL;
-  
-  if (text && text_len > 0) {
-    state->text = malloc(text_len + 1);
-    memcpy(state->text, text, text_len);
-    state->text[text_len] = '\0';
-  }
-  
-  // For selection operations
-  if (type == UNDO_DELETE_SELECTION) {
-    state->sel_start_cy = E.sel_start_cy;
-    state->sel_start_cx = E.sel_start_cx;
-    state->sel_end_cy = E.sel_end_cy;
-    state->sel_end_cx = E.sel_end_cx;
-  }
-  
-  // Clear redo history
+// Append a record with room for len + with_len bytes of text and
+// num_matches matches, dropping the redo history and, past
+// UNDO_MAX_BYTES, the oldest chunks.
+undoRecord *undoAlloc(enum undoType type, int cy, int cx, int len, int with_len, int num_matches) {
+  size_t size = undoRecordSize(len + with_len, num_matches);
   undoClearRedo();
-  
-  // Add to undo stack
-  if (E.undo_current) {
-    E.undo_current->next = state;
-    state->prev = E.undo_current;
-  } else {
-    state->prev = NULL;
-    E.undo_head = state;
+  undoChunk *c = E.undo_last;
+  if (!c || c->cap - c->used < size) {
+    size_t cap = size > UNDO_CHUNK ? size : UNDO_CHUNK;
+    c = malloc(sizeof(undoChunk) + cap);
+    c->used = 0; c->cap = cap;
+    c->prev = E.undo_last; c->next = NULL;
+    if (E.undo_last) E.undo_last->next = c; else E.undo_first = c;
+    E.undo_last = c; E.undo_bytes += cap;
   }
-  E.undo_current = state;
-  E.undo_count++;
-  
-  // Limit undo stack size
-  while (E.undo_count > MAX_UNDO) {
-    undoState *old = E.undo_head;
-    E.undo_head = old->next;
-    if (E.undo_head) E.undo_head->prev = NULL;
-    undoFreeState(old);
-    E.undo_count--;
+  undoRecord *r = (undoRecord *)(c->data + c->used);
+  *r = (undoRecord){ type, cy, cx, E.cy, E.cx, len, with_len, num_matches, E.undo_reload };
+  if (E.undo_reload) E.undo_reload = 2;
+  undoSetSize(r, size);
+  c->used += size;
+  E.undo_chunk = c; E.undo_pos = c->used;
+  while (E.undo_bytes > UNDO_MAX_BYTES && E.undo_first != c) undoFreeChunk(E.undo_first);
+  E.undo_open = 0;
+  return r;
+}
+
+// Grow the last record by text typed or deleted right where it ends, as
+// long as that doesn't start a new word and its chunk has room left.
+int undoExtend(enum undoType type, int cy, int cx, const char *text, int len) {
+  undoChunk *c; size_t off;
+  undoRecord *r = E.undo_open ? undoCurrent(&c, &off) : NULL;
+  if (!r || r->type != (int)type) return 0;
+  char *t = undoText(r);
+  int front = 0;
+  switch (type) {
+    case UNDO_INSERT_CHAR:
+      if (cy != r->cy || cx != r->cx + r->len) return 0;
+      if (!is_separator(text[0]) && is_separator(t[r->len - 1])) return 0;
+      break;
+    case UNDO_DELETE_CHAR:
+      // Backspace deletes in front of the run, Delete at its end.
+      if (cy != r->cy) return 0;
+      if (cx + len == r->cx) front = 1;
+      else if (cx != r->cx) return 0;
+      if (!is_separator(text[0]) && is_separator(front ? t[0] : t[r->len - 1])) return 0;
+      break;
+    case UNDO_INSERT_NEWLINE:
+      if (cy != r->cy + r->len || cx != 0) return 0;
+      break;
+    default:
+      return 0;
   }
+  size_t size = undoRecordSize(r->len + len, 0);
+  if (off + undoRecordSize(r->len, 0) != c->used || c->cap - off < size) return 0;
+  if (front) { memmove(t + len, t, r->len); memcpy(t, text, len); r->cx = cx; }
+  else memcpy(t + r->len, text, len);
+  r->len += len;
+  undoSetSize(r, size);
+  c->used = E.undo_pos = off + size;
+  return 1;
+}
+
+void undoPush(enum undoType type, int cy, int cx, const char *text, int len) {
+  if (E.in_undo) return;  // Don't record undo during undo/redo operations
+  if (undoExtend(type, cy, cx, text, len)) return;
+  undoRecord *r = undoAlloc(type, cy, cx, len, 0, 0);
+  if (len) memcpy(undoText(r), text, len);
+  E.undo_open = type == UNDO_INSERT_CHAR || type == UNDO_DELETE_CHAR ||
+                type == UNDO_INSERT_NEWLINE;
 }
 
 void undoPushSelectionDeletion() {
   if (E.in_undo || !E.selection_active) return;
+  if (E.sel_start_cy == E.sel_end_cy && E.sel_start_cx == E.sel_end_cx) return;
   
-  // Save the deleted content
-  int start_cy = E.sel_start_cy;
-  int start_cx = E.sel_start_cx;
-  int end_cy = E.sel_end_cy;
-  int end_cx = E.sel_end_cx;
-  
-  undoState *state = malloc(sizeof(undoState));
-  state->type = UNDO_DELETE_SELECTION;
-  state->cy = start_cy;
-  state->cx = start_cx;
-  state->prev_cy = E.cy;
-  state->prev_cx = E.cx;
-  state->sel_start_cy = start_cy;
-  state->sel_start_cx = start_cx;
-  state->sel_end_cy = end_cy;
-  state->sel_end_cx = end_cx;
-  state->text = NULL;
-  state->text_len = 0;
-  state->c = 0;
-  state->next = NULL;
-  state->prev = NULL;
-  
-  // Save deleted lines
-  if (start_cy == end_cy) {
-    state->num_lines = 1;
-    state->lines = malloc(sizeof(char*));
-    int len = end_cx - start_cx;
-    state->lines[0] = malloc(len + 1);
-    memcpy(state->lines[0], &E.row[start_cy].chars[start_cx], len);
-    state->lines[0][len] = '\0';
-  } else {
-    state->num_lines = end_cy - start_cy + 1;
-    state->lines = malloc(sizeof(char*) * state->num_lines);
-    
-    // First line
-    erow *row = &E.row[start_cy];
-    int len = row->size - start_cx;
-    state->lines[0] = malloc(len + 1);
-    memcpy(state->lines[0], &row->chars[start_cx], len);
-    state->lines[0][len] = '\0';
-    
-    // Middle lines
-    for (int i = 1; i < state->num_lines - 1; i++) {
-      row = &E.row[start_cy + i];
-      state->lines[i] = malloc(row->size + 1);
-      memcpy(state->lines[i], row->chars, row->size);
-      state->lines[i][row->size] = '\0';
-    }
-    
-    // Last line
-    row = &E.row[end_cy];
-    state->lines[state->num_lines - 1] = malloc(end_cx + 1);
-    memcpy(state->lines[state->num_lines - 1], row->chars, end_cx);
-    state->lines[state->num_lines - 1][end_cx] = '\0';
-  }
-  
-  undoClearRedo();
-  
-  if (E.undo_current) {
-    E.undo_current->next = state;
-    state->prev = E.undo_current;
-  } else {
-    E.undo_head = state;
-  }
-  E.undo_current = state;
-  E.undo_count++;
-  
-  while (E.undo_count > MAX_UNDO) {
-    undoState *old = E.undo_head;
-    E.undo_head = old->next;
-    if (E.undo_head) E.undo_head->prev = NULL;
-    undoFreeState(old);
-    E.undo_count--;
-  }
+  // Save the deleted content, lines joined by '\n'
+  int len = editorCopyRange(E.sel_start_cy, E.sel_start_cx, E.sel_end_cy, E.sel_end_cx, NULL);
+  undoRecord *r = undoAlloc(UNDO_DELETE_SELECTION, E.sel_start_cy, E.sel_start_cx, len, 0, 0);
+  editorCopyRange(E.sel_start_cy, E.sel_start_cx, E.sel_end_cy, E.sel_end_cx, undoText(r));
 }
 
-void editorUndo() {
-  if (!E.undo_current) {
-    editorSetStatusMessage("Nothing to undo");
-    return;
-  }
+// Take back the change r records.
+void undoRevert(undoRecord *r) {
+  char *text = undoText(r);
+  int end_cy, end_cx;
+  editorTextEnd(r->cy, r->cx, text, r->len, &end_cy, &end_cx);
   
-  E.in_undo = 1;
-  undoState *state = E.undo_current;
-  
-  switch (state->type) {
+  switch (r->type) {
     case UNDO_INSERT_CHAR:
-      // Undo character insertion by deleting it
-      E.cy = state->cy;
-      E.cx = state->cx + 1;
-      if (E.cy < E.numrows) {
-        editorRowDelChar(&E.row[E.cy], state->cx);
-      }
-      E.cx = state->cx;
+    case UNDO_INSERT_NEWLINE:
+      // Undo typing by deleting it. Newlines entered on the line past the
+      // end of the buffer only added rows.
+      if (r->type == UNDO_INSERT_NEWLINE && end_cy >= E.numrows) editorDelRows(r->cy, r->len);
+      else editorDeleteRange(r->cy, r->cx, end_cy, end_cx);
+      E.cy = r->cy;
+      E.cx = r->cx;
       break;
       
     case UNDO_DELETE_CHAR:
-      // Undo character deletion by inserting it back
-      E.cy = state->cy;
-      E.cx = state->cx;
-      if (E.cy < E.numrows) {
-        editorRowInsertChar(&E.row[E.cy], state->cx, state->c);
-      }
-      break;
-      
-    case UNDO_INSERT_NEWLINE:
-      // Undo newline insertion
-      E.cy = state->cy + 1;
-      E.cx = 0;
-      if (E.cy < E.numrows && state->cy >= 0 && state->cy < E.numrows) {
-        erow *row = &E.row[E.cy];
-        editorRowAppendString(&E.row[state->cy], row->chars, row->size);
-        editorDelRow(E.cy);
-      }
-      E.cy = state->cy;
-      E.cx = state->cx;
+    case UNDO_DELETE_SELECTION:
+      // Undo deletion by inserting the text back
+      editorInsertText(r->cy, r->cx, text, r->len);
+      E.cy = r->prev_cy;
+      E.cx = r->prev_cx;
       break;
       
     case UNDO_DELETE_NEWLINE:
       // Undo newline deletion by splitting the line
-      E.cy = state->cy;
-      E.cx = state->cx;
-      if (E.cy < E.numrows) {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[state->cx], row->size - state->cx);
-        row = &E.row[E.cy];
-        row->size = state->cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+      editorInsertText(r->cy, r->cx, "\n", 1);
+      E.cy = r->cy;
+      E.cx = r->cx;
+      break;
+
+    case UNDO_INSERT_TEXT:
+      editorDeleteRange(r->cy, r->cx, end_cy, end_cx);
+      E.cy = r->cy;
+      E.cx = r->cx;
+      break;
+
+    case UNDO_INSERT_LINES:
+      editorDelRows(r->cy, end_cy - r->cy + 1);
+      E.cy = r->cy;
+      E.cx = 0;
+      break;
+
+    case UNDO_DELETE_LINES:
+      editorInsertLines(r->cy, text, r->len);
+      E.cy = r->prev_cy;
+      E.cx = r->prev_cx;
+      break;
+
+    case UNDO_REPLACE_ALL: {
+      // The replacements sit where the matches were, shifted by the
+      // size change of the ones before them on the row.
+      findMatch *matches = undoMatches(r);
+      findMatch *m = malloc(sizeof(findMatch) * r->num_matches);
+      for (int j = 0, shift = 0; j < r->num_matches; j++) {
+        if (j && matches[j].row != matches[j - 1].row) shift = 0;
+        m[j] = (findMatch){ matches[j].row, matches[j].col + shift, r->with_len };
+        shift += r->with_len - matches[j].len;
       }
+      editorReplaceMatches(m, r->num_matches, text, r->len);
+      free(m);
+      E.cy = r->prev_cy;
+      E.cx = r->prev_cx;
+    } break;
+  }
+}
+// Make the change r records again.
+void undoReapply(undoRecord *r) {
+  char *text = undoText(r);
+  int end_cy, end_cx;
+  editorTextEnd(r->cy, r->cx, text, r->len, &end_cy, &end_cx);
+  
+  switch (r->type) {
+    case UNDO_INSERT_CHAR:
+    case UNDO_INSERT_NEWLINE:
+      // Redo typing. Newlines entered past the end only add rows.
+      if (r->type == UNDO_INSERT_NEWLINE && r->cy >= E.numrows) editorInsertLines(r->cy, text, r->len - 1);
+      else editorInsertText(r->cy, r->cx, text, r->len);
+      E.cy = end_cy;
+      E.cx = end_cx;
       break;
       
+    case UNDO_DELETE_CHAR:
     case UNDO_DELETE_SELECTION:
-      // Restore deleted selection
-      if (state->num_lines == 1) {
-        E.cy = state->sel_start_cy;
-        E.cx = state->sel_start_cx;
-        if (E.cy < E.numrows) {
-          for (int i = 0; state->lines[0][i]; i++) {
-            editorRowInsertChar(&E.row[E.cy], E.cx + i, state->lines[0][i]);
-          }
-        }
-      } else {
-        // Multi-line restoration
-        E.cy = state->sel_start_cy;
-        E.cx = state->sel_start_cx;
-        if (E.cy < E.numrows) {
-          // Split current line
-          erow *row = &E.row[E.cy];
-          char *saved_end = NULL;
-          int saved_len = 0;
-          if (E.cx < row->size) {
-            saved_len = row->size - E.cx;
-            saved_end = malloc(saved_len + 1);
-            memcpy(saved_end, &row->chars[E.cx], saved_len);
-            saved_end[saved_len] = '\0';
-            row->size = E.cx;
-            row->chars[row->size] = '\0';
-            editorUpdateRow(row);
-          }
-          
-          // Insert first line fragment
-          for (int i = 0; state->lines[0][i]; i++) {
-            editorRowInsertChar(&E.row[E.cy], E.cx + i, state->lines[0][i]);
-          }
-          
-          // Insert middle complete lines
-          for (int i = 1; i < state->num_lines - 1; i++) {
-            editorInsertRow(E.cy + i, state->lines[i], strlen(state->lines[i]));
-          }
-          
-          // Insert last line
-          int last_idx = state->num_lines - 1;
-          editorInsertRow(E.cy + last_idx, state->lines[last_idx], strlen(state->lines[last_idx]));
-          
-          // Append saved end
-          if (saved_end) {
-            editorRowAppendString(&E.row[E.cy + last_idx], saved_end, saved_len);
-            free(saved_end);
-          }
-        }
-      }
-      E.cy = state->prev_cy;
-      E.cx = state->prev_cx;
+      // Redo deletion
+      editorDeleteRange(r->cy, r->cx, end_cy, end_cx);
+      E.cy = r->cy;
+      E.cx = r->cx;
+      break;
+      
+    case UNDO_DELETE_NEWLINE:
+      // Redo newline deletion
+      editorDeleteRange(r->cy, r->cx, r->cy + 1, 0);
+      E.cy = r->cy;
+      E.cx = r->cx;
+      break;
+
+    case UNDO_INSERT_TEXT:
+    case UNDO_INSERT_LINES:
+      if (r->type == UNDO_INSERT_LINES) editorInsertLines(r->cy, text, r->len);
+      else editorInsertText(r->cy, r->cx, text, r->len);
+      E.cy = end_cy;
+      E.cx = end_cx;
+      break;
+
+    case UNDO_DELETE_LINES:
+      editorDelRows(r->cy, end_cy - r->cy + 1);
+      E.cy = r->cy;
+      E.cx = 0;
+      break;
+
+    case UNDO_REPLACE_ALL:
+      editorReplaceMatches(undoMatches(r), r->num_matches, text + r->len, r->with_len);
+      E.cy = r->prev_cy;
+      E.cx = r->prev_cx;
+      if (E.cy < E.numrows && E.cx > editorRow(E.cy)->size) E.cx = editorRow(E.cy)->size;
       break;
   }
+}
+
+// A reload is undone and redone in one step, and leaves the buffer
+// different from the file.
+void editorUndo() {
+  undoChunk *chunk; size_t off;
+  undoRecord *r = undoCurrent(&chunk, &off), *first = r;
+  // The history may have dropped the start of a reload, which then stays.
+  undoChunk *c = chunk; size_t o = off;
+  while (first && first->reload == 2) first = undoBefore(c, o, &c, &o);
+  if (!first) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  if (editorCutShort()) return;
+  editorEndView();
   
-  E.undo_current = state->prev;
+  E.in_undo = 1;
+  int reload = r->reload;
+  for (;;) {
+    undoRevert(r);
+    E.undo_chunk = chunk; E.undo_pos = off;
+    if (r->reload != 2 || !(r = undoCurrent(&chunk, &off))) break;
+  }
+  E.undo_open = 0;
   E.in_undo = 0;
+  if (reload) E.dirty++;
   editorSetStatusMessage("Undo");
 }
 
 void editorRedo() {
-  if (!E.undo_current) {
-    if (!E.undo_head) {
-      editorSetStatusMessage("Nothing to redo");
-      return;
-    }
-    E.undo_current = E.undo_head;
-  } else if (!E.undo_current->next) {
+  undoChunk *chunk; size_t off;
+  undoRecord *r = undoNext(&chunk, &off);
+  if (!r) {
     editorSetStatusMessage("Nothing to redo");
     return;
-  } else {
-    E.undo_current = E.undo_current->next;
   }
+  if (editorCutShort()) return;
+  editorEndView();
   
   E.in_undo = 1;
-  undoState *state = E.undo_current;
-  
-  switch (state->type) {
-    case UNDO_INSERT_CHAR:
-      // Redo character insertion
-      E.cy = state->cy;
-      E.cx = state->cx;
-      if (E.cy >= E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
-      }
-      editorRowInsertChar(&E.row[E.cy], state->cx, state->c);
-      E.cx++;
-      break;
-      
-    case UNDO_DELETE_CHAR:
-      // Redo character deletion
-      E.cy = state->cy;
-      E.cx = state->cx + 1;
-      if (E.cy < E.numrows) {
-        editorRowDelChar(&E.row[E.cy], state->cx);
-      }
-      E.cx = state->cx;
-      break;
-      
-    case UNDO_INSERT_NEWLINE:
-      // Redo newline insertion
-      E.cy = state->cy;
-      E.cx = state->cx;
-      if (E.cy < E.numrows) {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
-      } else {
-        editorInsertRow(E.cy, "", 0);
-      }
-      E.cy++;
-      E.cx = 0;
-      break;
-      
-    case UNDO_DELETE_NEWLINE:
-      // Redo newline deletion
-      E.cy = state->cy + 1;
-      if (E.cy < E.numrows && state->cy >= 0 && state->cy < E.numrows) {
-        erow *row = &E.row[E.cy];
-        editorRowAppendString(&E.row[state->cy], row->chars, row->size);
-        editorDelRow(E.cy);
-      }
-      E.cy = state->cy;
-      E.cx = state->cx;
-      break;
-      
-    case UNDO_DELETE_SELECTION:
-      // Redo selection deletion
-      E.cy = state->sel_start_cy;
-      E.cx = state->sel_start_cx;
-      
-      if (state->num_lines == 1) {
-        if (E.cy < E.numrows) {
-          erow *row = &E.row[E.cy];
-          int len = state->sel_end_cx - state->sel_start_cx;
-          memmove(&row->chars[state->sel_start_cx], 
-                  &row->chars[state->sel_end_cx], 
-                  row->size - state->sel_end_cx + 1);
-          row->size -= len;
-          editorUpdateRow(row);
-        }
-      } else {
-        if (E.cy < E.numrows) {
-          erow *start_row = &E.row[state->sel_start_cy];
-          erow *end_row = &E.row[state->sel_end_cy];
-          int end_len = end_row->size - state->sel_end_cx;
-          start_row->chars = realloc(start_row->chars, state->sel_start_cx + end_len + 1);
-          memcpy(&start_row->chars[state->sel_start_cx], 
-                 &end_row->chars[state->sel_end_cx], end_len);
-          start_row->size = state->sel_start_cx + end_len;
-          start_row->chars[start_row->size] = '\0';
-          
-          for (int i = state->sel_end_cy; i > state->sel_start_cy; i--) {
-            editorDelRow(i);
-          }
-          editorUpdateRow(&E.row[state->sel_start_cy]);
-        }
-      }
-      break;
+  int reload = r->reload;
+  for (;;) {
+    undoReapply(r);
+    E.undo_chunk = chunk;
+    E.undo_pos = off + undoRecordSize(r->len + r->with_len, r->num_matches);
+    if (!(r = undoNext(&chunk, &off)) || r->reload != 2) break;
   }
-  
+  E.undo_open = 0;
   E.in_undo = 0;
+  if (reload) E.dirty++;
   editorSetStatusMessage("Redo");
 }
 
 void editorDeleteSelection();
 void editorInsertChar(int c) {
+  if (editorCutShort()) return;
+  editorEndView();
   if (E.selection_active) editorDeleteSelection();
-  if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+  if (E.cy == E.numrows) {
+    undoPush(UNDO_INSERT_NEWLINE, E.cy, 0, "\n", 1);
+    editorInsertRow(E.numrows, "", 0);
+  }
   
   // Save undo state
-  undoPush(UNDO_INSERT_CHAR, E.cy, E.cx, c, NULL, 0);
+  char ch = c;
+  undoPush(UNDO_INSERT_CHAR, E.cy, E.cx, &ch, 1);
   
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  editorRowInsertChar(editorRow(E.cy), E.cx, c);
   E.cx++;
 }
 void editorInsertNewline() {
+  if (editorCutShort()) return;
+  editorEndView();
   if (E.selection_active) editorDeleteSelection();
   
   // Save undo state
-  undoPush(UNDO_INSERT_NEWLINE, E.cy, E.cx, 0, NULL, 0);
+  undoPush(UNDO_INSERT_NEWLINE, E.cy, E.cx, "\n", 1);
   
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
+  if (E.cy == E.numrows) editorInsertRow(E.cy, "", 0);
+  else editorInsertText(E.cy, E.cx, "\n", 1);
+  E.cy++; E.cx = 0;
+}
+// Insert pasted text as one edit and one undo step. Past the end of the
+// buffer its lines become new rows, so undo removes exactly those.
+void editorPasteText(const char *text, int len) {
+  if (editorCutShort()) return;
+  editorEndView();
+  if (E.selection_active) editorDeleteSelection();
+  if (!len) return;
+  int end_cy, end_cx;
+  if (E.cy == E.numrows) {
+    undoPush(UNDO_INSERT_LINES, E.cy, 0, text, len);
+    editorInsertLines(E.cy, text, len);
+    editorTextEnd(E.cy, 0, text, len, &end_cy, &end_cx);
   } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    undoPush(UNDO_INSERT_TEXT, E.cy, E.cx, text, len);
+    editorInsertText(E.cy, E.cx, text, len);
+    editorTextEnd(E.cy, E.cx, text, len, &end_cy, &end_cx);
   }
-  E.cy++; E.cx = 0;
+  E.cy = end_cy; E.cx = end_cx;
+}
+void editorPaste() {
+  int len;
+  char *text = editorReadPaste(&len);
+  editorPasteText(text, len);
+  free(text);
 }
 void editorDelChar() {
+  if (editorCutShort()) return;
+  editorEndView();
   if (E.cy == E.numrows) return;
   if (E.cx == 0 && E.cy == 0) return;
-  erow *row = &E.row[E.cy];
+  erow *row = editorRow(E.cy);
   if (E.cx > 0) {
     // Save undo state
-    char deleted_char = row->chars[E.cx - 1];
-    undoPush(UNDO_DELETE_CHAR, E.cy, E.cx - 1, deleted_char, NULL, 0);
+    undoPush(UNDO_DELETE_CHAR, E.cy, E.cx - 1, &row->chars[E.cx - 1], 1);
     
     editorRowDelChar(row, E.cx - 1);
     E.cx--;
   } else {
     // Save undo state
-    undoPush(UNDO_DELETE_NEWLINE, E.cy - 1, E.row[E.cy - 1].size, 0, NULL, 0);
+    undoPush(UNDO_DELETE_NEWLINE, E.cy - 1, editorRow(E.cy - 1)->size, NULL, 0);
     
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
+    E.cx = editorRow(E.cy - 1)->size;
+    editorDeleteRange(E.cy - 1, E.cx, E.cy, 0);
     E.cy--;
   }
 }
@@ -870,6 +1775,8 @@ void editorNormalizeSelection() {
 }
 void editorClearSelection() { E.selection_active = 0; }
 void editorDeleteSelection() {
+  if (editorCutShort()) return;
+  editorEndView();
     if (!E.selection_active) return;
     editorNormalizeSelection();
     
@@ -877,49 +1784,392 @@ void editorDeleteSelection() {
     undoPushSelectionDeletion();
     
     E.cy = E.sel_start_cy; E.cx = E.sel_start_cx;
-    erow *start_row = &E.row[E.sel_start_cy];
-    erow *end_row = &E.row[E.sel_end_cy];
-    if (E.sel_start_cy == E.sel_end_cy) {
-        int len = E.sel_end_cx - E.sel_start_cx;
-        if (len > 0) {
-            memmove(&start_row->chars[E.sel_start_cx], &start_row->chars[E.sel_end_cx], start_row->size - E.sel_end_cx + 1);
-            start_row->size -= len;
-            editorUpdateRow(start_row);
-        }
-    } else { 
-        int end_len = end_row->size - E.sel_end_cx;
-        start_row->chars = realloc(start_row->chars, E.sel_start_cx + end_len + 1);
-        memcpy(&start_row->chars[E.sel_start_cx], &end_row->chars[E.sel_end_cx], end_len);
-        start_row->size = E.sel_start_cx + end_len;
-        start_row->chars[start_row->size] = '\0';
-        for (int i = E.sel_end_cy; i > E.sel_start_cy; i--) {
-            editorDelRow(i);
-        }
-        editorUpdateRow(&E.row[E.sel_start_cy]);
-    }
+    editorDeleteRange(E.sel_start_cy, E.sel_start_cx, E.sel_end_cy, E.sel_end_cx);
     E.dirty++; editorClearSelection();
 }
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  for (int j = 0; j < E.numrows; j++) totlen += E.row[j].size + 1;
-  *buflen = totlen;
-  char *buf = malloc(totlen); char *p = buf;
+// Saving works on a snapshot of the rows, taken in O(1) on the editing
+// thread: the saver thread walks the tree as it was while editing goes on.
+// Rows are gathered into a batch of at most SAVE_IOVS segments or
+// SAVE_CHUNK bytes that is written with writev before the walk goes on, so
+// a save takes the same memory whatever the size of the file. A segment
+// that continues the previous one in memory extends it, so a run of lines
+// from the mapped file, newlines and all, takes one.
+saveJob *saveSnapshot(const char *path) {
+  saveJob *s = calloc(1, sizeof(saveJob));
+  s->path = strdup(path);
+  s->gen = ++E.save_gen; s->changes = E.changes;
+  s->root = E.rows; s->rows = E.numrows;
+  s->map = E.map; s->map_size = E.map_size; s->line_off = E.line_off;
+  return s;
+}
+void saveFree(saveJob *s) {
+  for (size_t j = 0; j < s->nkept; j++) free(s->kept[j]);
+  free(s->kept); free(s->path); free(s);
+}
+int save_wake[2] = {-1, -1};  // The saver writes a byte here per batch
+typedef struct saveBatch {
+  struct iovec iov[SAVE_IOVS]; int n, rows; size_t bytes;
+} saveBatch;
+// Write the batch out, reporting progress. Returns 0, or -1 with errno set.
+int saveFlush(saveJob *s, saveBatch *b, int fd) {
+  struct iovec *iov = b->iov;
+  int n = b->n;
+  while (n) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) { if (errno == EINTR) continue; return -1; }
+    for (; n && (size_t)w >= iov->iov_len; iov++, n--) w -= iov->iov_len;
+    if (n) { iov->iov_base = (char *)iov->iov_base + w; iov->iov_len -= w; }
+  }
+  s->total += b->bytes;
+  __atomic_add_fetch(&s->done_rows, b->rows, __ATOMIC_RELAXED);
+  b->n = b->rows = 0; b->bytes = 0;
+  if (save_wake[1] != -1 && write(save_wake[1], "", 1) == -1) { /* pipe full */ }
+  return 0;
+}
+int saveAppend(saveJob *s, saveBatch *b, int fd, const char *p, size_t len) {
+  struct iovec *last = b->n ? &b->iov[b->n - 1] : NULL;
+  if (last && (char *)last->iov_base + last->iov_len == p && last->iov_len < SAVE_CHUNK) {
+    last->iov_len += len;
+  } else {
+    if ((b->n == SAVE_IOVS || b->bytes >= SAVE_CHUNK) && saveFlush(s, b, fd) == -1)
+      return -1;
+    b->iov[b->n++] = (struct iovec){ (void *)p, len };
+  }
+  b->bytes += len;
+  return 0;
+}
+// Write the rows of node to the batch, each followed by a newline.
+int saveNode(saveJob *s, saveBatch *b, int fd, rowNode *node) {
+  if (node->src < 0) {
+    b->rows++;
+    return saveAppend(s, b, fd, node->row.chars, node->row.size) == -1 ||
+           saveAppend(s, b, fd, "\n", 1) == -1 ? -1 : 0;
+  }
+  for (int j = 0; j < node->lines; j++) {
+    size_t start = s->line_off[node->src + j], end = s->line_off[node->src + j + 1] - 1;
+    while (end > start && s->map[end - 1] == '\r') end--;
+    // A mapped line is followed by its newline unless it ends in "\r\n"
+    // or is the last of a file without a final newline.
+    int nl = end < s->map_size && s->map[end] == '\n';
+    if (saveAppend(s, b, fd, &s->map[start], end - start + nl) == -1 ||
+        (!nl && saveAppend(s, b, fd, "\n", 1) == -1))
+      return -1;
+    b->rows++;
+  }
+  return 0;
+}
+// Walk the snapshot in line order, writing it to fd. Returns 0, or -1 with
+// errno set.
+int saveWrite(saveJob *s, int fd) {
+  saveBatch *volatile b = calloc(1, sizeof(saveBatch));
+  rowNode **volatile stack = NULL;
+  // The file was cut short under a span: give up rather than write zeros.
+  sigjmp_buf jb, *outer = map_guard;
+  if (sigsetjmp(jb, 0)) {
+    map_guard = outer; free(stack); free(b);
+    errno = EIO;
+    return -1;
+  }
+  map_guard = &jb;
+  int top = 0, cap = 0, ret = 0;
+  rowNode *node = s->root;
+  while (ret == 0 && (node || top)) {
+    for (; node; node = node->left) {
+      if (top == cap) {
+        cap = cap ? cap * 2 : 64;
+        stack = realloc(stack, sizeof(rowNode *) * cap);
+      }
+      stack[top++] = node;
+    }
+    node = stack[--top];
+    ret = saveNode(s, b, fd, node);
+    node = node->right;
+  }
+  if (ret == 0 && b->n) ret = saveFlush(s, b, fd);
+  map_guard = outer;
+  free(stack); free(b);
+  return ret;
+}
+// Save a snapshot to its path atomically: write it into a temporary file
+// next to the file, fsync that and rename it over the file, so a crash
+// leaves either the old contents or the new ones. A symlink is followed
+// and the file's mode and owner are kept; hard links go on sharing the old
+// contents. Returns the bytes written, or -1 with errno set.
+ssize_t editorWriteFile(saveJob *s) {
+  char *target = realpath(s->path, NULL);
+  const char *path = target ? target : s->path;
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  int dirlen = name - path, namelen = strlen(name);
+  char tmp[dirlen + namelen + 9];  // DIR/.NAME.XXXXXX
+  memcpy(tmp, path, dirlen);
+  tmp[dirlen] = '.';
+  memcpy(&tmp[dirlen + 1], name, namelen);
+  memcpy(&tmp[dirlen + 1 + namelen], ".XXXXXX", 8);
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+  int fd = mkstemp(tmp);
+  if (fd == -1) { free(target); return -1; }
+  mode_t mask = umask(0); umask(mask);
+  fchmod(fd, exists ? st.st_mode & 07777 : 0666 & ~mask);
+  if (exists && fchown(fd, st.st_uid, st.st_gid) == -1) { /* keep our own */ }
+  int closed = 0;
+  if (saveWrite(s, fd) == -1 || fsync(fd) == -1 || (closed = 1, close(fd)) == -1 ||
+      rename(tmp, path) == -1) {
+    int saved = errno;
+    if (!closed) close(fd);
+    unlink(tmp); free(target);
+    errno = saved;
+    return -1;
+  }
+  // Make the rename itself durable.
+  char dir[dirlen + 2];
+  snprintf(dir, sizeof(dir), "%.*s", dirlen ? dirlen : 1, dirlen ? path : ".");
+  int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (dfd != -1) { fsync(dfd); close(dfd); }
+  free(target);
+  return s->total;
+}
+void *saveThread(void *arg) {
+  saveJob *s = arg;
+  s->error = editorWriteFile(s) == -1 ? errno : 0;
+  __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+  if (save_wake[1] != -1 && write(save_wake[1], "", 1) == -1) { /* pipe full */ }
+  return NULL;
+}
+// Line indexing is the one part of opening a file that has to touch every
+// byte. The kernels below find '\n' 16 or 32 bytes at a time and record the
+// offset just past it; CRLF needs no separate pass because it also ends in
+// '\n' and the '\r' is trimmed when the line is read. Files bigger than a
+// couple of chunks are split across threads and the per-chunk results are
+// stitched back together in order.
+#define INDEX_CHUNK_MIN (4 * 1024 * 1024)
+#define INDEX_MAX_THREADS 16
+typedef struct lineVec { size_t *v; size_t n, cap; } lineVec;
+typedef void (*indexKernel)(const char *buf, size_t len, size_t base, lineVec *out);
+void lineVecPush(lineVec *lv, size_t pos) {
+  if (lv->n == lv->cap) {
+    lv->cap = lv->cap ? lv->cap * 2 : 4096;
+    lv->v = realloc(lv->v, sizeof(size_t) * lv->cap);
+  }
+  lv->v[lv->n++] = pos;
+}
+void indexScalar(const char *buf, size_t len, size_t base, lineVec *out) {
+  const char *p = buf, *end = buf + len;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    p++; lineVecPush(out, base + (p - buf));
+  }
+}
+#ifdef __SSE2__
+void indexSSE2(const char *buf, size_t len, size_t base, lineVec *out) {
+  __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    while (mask) {
+      lineVecPush(out, base + i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  indexScalar(buf + i, len - i, base + i, out);
+}
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void indexAVX2(const char *buf, size_t len, size_t base, lineVec *out) {
+  __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    while (mask) {
+      lineVecPush(out, base + i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  indexScalar(buf + i, len - i, base + i, out);
+}
+#endif
+indexKernel editorIndexKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) return indexAVX2;
+#endif
+#ifdef __SSE2__
+  return indexSSE2;
+#else
+  return indexScalar;
+#endif
+}
+typedef struct indexJob {
+  indexKernel kernel; const char *buf; size_t len, base; lineVec out;
+} indexJob;
+void *indexWorker(void *arg) {
+  indexJob *job = arg;
+  job->kernel(job->buf + job->base, job->len, job->base, &job->out);
+  return NULL;
+}
+// Build the offset of every line start. line_off[n] points one past the
+// last line's terminator (or one past EOF if the last line has none), so
+// line i always spans [line_off[i], line_off[i + 1] - 1).
+int lineIndexBuild(const char *buf, size_t len, size_t **offs,
+                   indexKernel kernel, int threads) {
+  indexJob jobs[INDEX_MAX_THREADS];
+  pthread_t tids[INDEX_MAX_THREADS];
+  if (threads > INDEX_MAX_THREADS) threads = INDEX_MAX_THREADS;
+  if ((size_t)threads > len / INDEX_CHUNK_MIN) threads = len / INDEX_CHUNK_MIN;
+  if (threads < 1) threads = 1;
+  size_t chunk = len / threads;
+  for (int t = 0; t < threads; t++) {
+    jobs[t] = (indexJob){kernel, buf, t == threads - 1 ? len - t * chunk : chunk,
+                         t * chunk, {NULL, 0, 0}};
+  }
+  int started = 1;
+  for (; started < threads; started++) {
+    if (pthread_create(&tids[started], NULL, indexWorker, &jobs[started]) != 0) break;
+  }
+  for (int t = started; t < threads; t++) indexWorker(&jobs[t]);
+  indexWorker(&jobs[0]);
+  for (int t = 1; t < started; t++) pthread_join(tids[t], NULL);
+
+  size_t total = 1;
+  for (int t = 0; t < threads; t++) total += jobs[t].out.n;
+  size_t *off = malloc(sizeof(size_t) * (total + 1));
+  size_t n = 0;
+  off[n++] = 0;
+  for (int t = 0; t < threads; t++) {
+    memcpy(&off[n], jobs[t].out.v, sizeof(size_t) * jobs[t].out.n);
+    n += jobs[t].out.n;
+    free(jobs[t].out.v);
+  }
+  // The last recorded start is EOF itself when the file ends in a newline;
+  // it becomes the sentinel. Otherwise add one for the unterminated line.
+  if (off[n - 1] == len) n--;
+  else off[n] = len + 1;
+  *offs = off;
+  return n;
+}
+int editorIndexLines(const char *buf, size_t len, size_t **offs) {
+  return lineIndexBuild(buf, len, offs, editorIndexKernel(),
+                        sysconf(_SC_NPROCESSORS_ONLN));
+}
+// Map a file, index its line starts and represent the whole buffer as a
+// single unmaterialized span. Rows are copied out, rendered and highlighted
+// only when first looked up.
+int editorOpenMapped(char *filename, size_t size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return -1;
+  struct stat st;
+  char *map = fstat(fd, &st) == -1 ? MAP_FAILED :
+              mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+  madvise(map, size, MADV_SEQUENTIAL);
+  size_t *off;
+  int lines = editorIndexLines(map, size, &off);
+  madvise(map, size, MADV_RANDOM);
+  pthread_rwlock_wrlock(&rows_lock);
+  rowTreeFree(E.rows);
+  if (E.map) munmap(E.map, E.map_size);
+  free(E.line_off);
+  E.map = map; E.map_size = E.map_avail = size; E.line_off = off;
+  E.map_ino = st.st_ino;
+  rowTreeSetRoot(lines ? rowNodeNew(lines, 0) : NULL);
+  E.numrows = lines; E.hl_valid = 0;
+  pthread_rwlock_unlock(&rows_lock);
+  editorViewReset();
+  return 0;
+}
+// Copy every line of the mapped file into a real row and drop the mapping.
+void editorMaterializeAll() {
+  rowNode *span = E.rows, *first = NULL, *prev = NULL;
   for (int j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size; *p = '\n'; p++;
+    rowNode *node = rowNodeNew(1, -1);
+    int len; char *text = editorMappedLine(j, &len);
+    node->row.size = len;
+    node->row.chars = malloc(len + 1);
+    editorMapCopy(node->row.chars, text, len);
+    node->row.chars[len] = '\0';
+    node->prev = prev;
+    if (prev) prev->next = node; else first = node;
+    prev = node;
   }
-  return buf;
+  rowTreeSetRoot(rowTreeBuild(first, E.numrows));
+  free(span);
+  munmap(E.map, E.map_size); free(E.line_off);
+  E.map = NULL; E.map_size = 0; E.line_off = NULL;
+}
+// A size or line count from the environment, with an optional K, M or G.
+long long editorEnvSize(const char *name, long long def) {
+  char *s = getenv(name), *end;
+  if (!s || !*s) return def;
+  long long n = strtoll(s, &end, 10);
+  switch (*end) {
+  case 'G': case 'g': n *= 1024;  // fall through
+  case 'M': case 'm': n *= 1024;  // fall through
+  case 'K': case 'k': n *= 1024;
+  }
+  return n > 0 ? n : def;
+}
+// Large files open for viewing; the edit commands end that before their
+// first change, leaving the rest of large-file mode on.
+void editorEndView() {
+  if (!E.view) return;
+  E.view = 0;
+  editorSetStatusMessage("Editing a large file: highlighting follows the screen");
+}
+// The mapped file was cut short in place, as st now is (logrotate's
+// copytruncate, say): lines past its new end are gone from under the
+// spans, so they read as empty from here on (editorMappedLine) and the
+// buffer turns read-only until the file is loaded again.
+void editorMapCut(struct stat *st) {
+  if (!E.map || st->st_ino != E.map_ino || (size_t)st->st_size >= E.map_avail) return;
+  pthread_rwlock_wrlock(&rows_lock);
+  E.map_avail = st->st_size;
+  pthread_rwlock_unlock(&rows_lock);
+  editorViewReset();
+  E.frame_pending = 1;
+}
+// Whether the buffer is read-only, the mapped file having been cut short
+// under it; says so if it is. Nothing is written over the file then, as
+// the lines it lost would be saved as empty.
+int editorCutShort() {
+  if (!E.map || E.map_avail == E.map_size) return 0;
+  editorSetStatusMessage("%s was cut short on disk; read-only", E.filename);
+  return 1;
+}
+// Remember the version of the file the rows now hold.
+void editorNoteFile(struct stat *st) {
+  E.file_size = st->st_size; E.file_mtime = st->st_mtim; E.file_ino = st->st_ino;
+  E.disk_warned = E.disk_overwrite = 0;
 }
 void editorOpen(char *filename) {
   free(E.filename); E.filename = strdup(filename);
+  E.large = E.view = 0;
   editorSelectSyntaxHighlight();
+  struct stat st;
+  if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      editorOpenMapped(filename, st.st_size) == 0) {
+    E.large = st.st_size >= editorEnvSize("K8O4_LARGE_SIZE", LARGE_FILE_SIZE) ||
+              E.numrows >= editorEnvSize("K8O4_LARGE_LINES", LARGE_FILE_LINES);
+    E.view = E.large;
+    // Only large files stay lazily mapped; smaller ones are loaded up front.
+    if (!E.large && st.st_size < LAZY_OPEN_THRESHOLD) editorMaterializeAll();
+    E.dirty = 0; editorNoteFile(&st);
+    return;
+  }
+  memset(&st, 0, sizeof(st));
+  editorNoteFile(&st);
   FILE *fp = fopen(filename, "r");
   if (!fp) { if (errno != ENOENT) die("fopen"); return; }
+  if (fstat(fileno(fp), &st) == 0) editorNoteFile(&st);
+  E.file_size = 0;
   char *line = NULL; size_t linecap = 0; ssize_t linelen;
   
   // Don't record undo for initial file load
   E.in_undo = 1;
   while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    E.file_size += linelen;
     while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
       linelen--;
     editorInsertRow(E.numrows, line, linelen);
@@ -928,84 +2178,1795 @@ void editorOpen(char *filename) {
   
   free(line); fclose(fp); E.dirty = 0;
 }
+// Journal implementation
+unsigned journalSum(const char *p, size_t len) {
+  unsigned h = 2166136261u;
+  for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)p[i]) * 16777619u;
+  return h;
+}
+int journalWrite(int fd, const void *p, size_t len) {
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write(fd, (const char *)p + done, len - done);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return 0;
+}
+// Where the journal of a file goes: .NAME.k8o4.swp in its directory.
+char *journalPath(const char *filename) {
+  const char *name = strrchr(filename, '/');
+  name = name ? name + 1 : filename;
+  size_t dirlen = name - filename;
+  char *path = malloc(strlen(filename) + 12);
+  sprintf(path, "%.*s.%s.k8o4.swp", (int)dirlen, filename, name);
+  return path;
+}
+// The version of a file on disk, as a journal header names it.
+void journalBase(journalHeader *h, const char *filename) {
+  struct stat st;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "k8o4jnl1", 8);
+  if (stat(filename, &st) == -1) return;
+  h->size = st.st_size;
+  h->mtime_sec = st.st_mtim.tv_sec; h->mtime_nsec = st.st_mtim.tv_nsec;
+}
+// The writer thread: wait for changes, let more gather for JOURNAL_SYNC_MS,
+// then write them as one batch and fsync. The swap file is created with
+// the first batch after the journal is started.
+void *journalWriter(void *arg) {
+  (void)arg;
+  journal *j = &E.journal;
+  char *buf = NULL; size_t cap = 0;
+  pthread_mutex_lock(&journal_lock);
+  while (1) {
+    while (!j->len) pthread_cond_wait(&journal_wake, &journal_lock);
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += JOURNAL_SYNC_MS * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L; until.tv_nsec %= 1000000000L;
+    while (j->len && pthread_cond_timedwait(&journal_wake, &journal_lock, &until) == 0);
+    if (!j->len) continue;  // Discarded meanwhile
+    char *batch = j->buf; size_t len = j->len, batch_cap = j->cap;
+    j->buf = buf; j->cap = cap; j->len = 0;
+    buf = batch; cap = batch_cap;
+    pthread_mutex_lock(&journal_io);
+    if (j->fd == -1 && j->path) {
+      j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+      if (j->fd != -1 && journalWrite(j->fd, &j->base, sizeof(j->base)) == -1) {
+        close(j->fd); j->fd = -1;
+      }
+    }
+    int fd = j->fd;
+    pthread_mutex_unlock(&journal_lock);
+    journalBatch b = { len, journalSum(buf, len), 0 };
+    if (fd != -1 && journalWrite(fd, &b, sizeof(b)) == 0 && journalWrite(fd, buf, len) == 0)
+      fdatasync(fd);
+    pthread_mutex_unlock(&journal_io);
+    pthread_mutex_lock(&journal_lock);
+  }
+  return NULL;
+}
+// Drop the journal: changes not yet written, and the swap file.
+void journalDiscard() {
+  journal *j = &E.journal;
+  pthread_mutex_lock(&journal_lock);
+  j->len = 0;
+  pthread_mutex_lock(&journal_io);
+  if (j->fd != -1) { close(j->fd); j->fd = -1; }
+  if (j->path) unlink(j->path);
+  free(j->path); j->path = NULL;  // Nothing journals until the next start
+  pthread_mutex_unlock(&journal_io);
+  pthread_mutex_unlock(&journal_lock);
+}
+// Journal changes from now on, against the file as it is on disk.
+void journalStart() {
+  journal *j = &E.journal;
+  journalDiscard();
+  pthread_mutex_lock(&journal_lock);
+  free(j->path); j->path = journalPath(E.filename);
+  journalBase(&j->base, E.filename);
+  pthread_mutex_unlock(&journal_lock);
+}
+// A save is taking its snapshot: keep the changes made from now on too.
+void journalSnapshot() {
+  pthread_mutex_lock(&journal_lock);
+  E.journal.since_len = 0; E.journal.keep_since = 1;
+  pthread_mutex_unlock(&journal_lock);
+}
+// The save is over. If the file now holds the snapshot, journal against
+// it, starting with the changes made since the snapshot was taken.
+void journalSaved(int ok) {
+  journal *j = &E.journal;
+  if (ok && !j->path) { journalStart(); return; }
+  pthread_mutex_lock(&journal_lock);
+  if (ok) {
+    pthread_mutex_lock(&journal_io);
+    if (j->fd != -1) { close(j->fd); j->fd = -1; }
+    char *buf = j->buf; size_t cap = j->cap;
+    j->buf = j->since; j->cap = j->since_cap; j->len = j->since_len;
+    j->since = buf; j->since_cap = cap;
+    journalBase(&j->base, E.filename);
+    if (j->len) pthread_cond_signal(&journal_wake);
+    else unlink(j->path);
+    pthread_mutex_unlock(&journal_io);
+  }
+  j->since_len = 0; j->keep_since = 0;
+  pthread_mutex_unlock(&journal_lock);
+}
+// Apply a batch of journaled changes. Returns how many there were, or -1
+// if one doesn't fit the buffer.
+int journalReplay(const char *p, size_t len) {
+  int n = 0;
+  for (size_t off = 0; off + sizeof(journalRecord) <= len; n++) {
+    journalRecord r;
+    memcpy(&r, p + off, sizeof(r));
+    const char *text = p + off + sizeof(r);
+    if (r.size < 0 || (size_t)r.size > len - off - sizeof(r)) return -1;
+    off += sizeof(r) + r.size;
+    erow *row = r.a >= 0 && r.a < E.numrows ? editorRow(r.a) : NULL;
+    switch (r.type) {
+      case J_INSERT_ROW:
+      case J_INSERT_LINES:
+        if (r.a < 0 || r.a > E.numrows) return -1;
+        if (r.type == J_INSERT_ROW) editorInsertRow(r.a, (char *)text, r.size);
+        else editorInsertLines(r.a, text, r.size);
+        break;
+      case J_DEL_ROWS:
+        if (!row || r.b <= 0 || r.b > E.numrows - r.a) return -1;
+        editorDelRows(r.a, r.b);
+        break;
+      case J_ROW_INSERT:
+        if (!row) return -1;
+        editorRowInsertChars(row, r.b, text, r.size);
+        break;
+      case J_ROW_DELETE:
+        if (!row) return -1;
+        editorRowDelChars(row, r.b, r.c);
+        break;
+      case J_REPLACE: {
+        if (r.a < 0 || (size_t)r.a > r.size / sizeof(findMatch)) return -1;
+        findMatch *m = malloc(sizeof(findMatch) * r.a + 1);
+        memcpy(m, text, sizeof(findMatch) * r.a);
+        int ok = 1;
+        for (int k = 0; k < r.a && ok; k++) {
+          int from = k && m[k].row == m[k - 1].row ? m[k - 1].col + m[k - 1].len : 0;
+          ok = m[k].row < E.numrows && (!k || m[k].row >= m[k - 1].row) &&
+               m[k].col >= from && m[k].len >= 0 &&
+               m[k].col + m[k].len <= editorRow(m[k].row)->size;
+        }
+        if (ok) editorReplaceMatches(m, r.a, text + sizeof(findMatch) * r.a,
+                                     r.size - sizeof(findMatch) * r.a);
+        free(m);
+        if (!ok) return -1;
+      } break;
+      default:
+        return -1;
+    }
+  }
+  return n;
+}
+// Look for the journal of an editor that didn't exit cleanly. If it was
+// kept against this version of the file, replay its intact batches and
+// go on journaling into it; if against another, move it aside.
+void journalRecover() {
+  journal *j = &E.journal;
+  char *path = journalPath(E.filename);
+  journalHeader base;
+  journalBase(&base, E.filename);
+  int fd = open(path, O_RDWR);
+  struct stat st;
+  char *map = MAP_FAILED;
+  if (fd != -1 && fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(base))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    if (fd != -1) close(fd);
+    free(path); journalStart();
+    return;
+  }
+  if (memcmp(map, &base, sizeof(base))) {
+    char aside[strlen(path) + 5];
+    sprintf(aside, "%s.old", path);
+    rename(path, aside);
+    editorSetStatusMessage("%s is from another version of the file; moved to %s", path, aside);
+    munmap(map, st.st_size); close(fd);
+    free(path); journalStart();
+    return;
+  }
+  size_t off = sizeof(base), size = st.st_size;
+  int changes = 0, n = 0;
+  E.view = 0;
+  E.in_undo = 1;
+  while (n >= 0 && off + sizeof(journalBatch) <= size) {
+    journalBatch b;
+    memcpy(&b, map + off, sizeof(b));
+    if (b.len > size - off - sizeof(b) || journalSum(map + off + sizeof(b), b.len) != b.sum) break;
+    if ((n = journalReplay(map + off + sizeof(b), b.len)) > 0) changes += n;
+    off += sizeof(b) + b.len;
+  }
+  E.in_undo = 0;
+  munmap(map, size);
+  // Drop a batch torn by the crash, and append after the intact ones.
+  if (ftruncate(fd, off) == -1 || lseek(fd, off, SEEK_SET) == -1) {
+    close(fd); free(path); journalStart();
+    return;
+  }
+  pthread_mutex_lock(&journal_lock);
+  free(j->path); j->path = path; j->base = base; j->fd = fd;
+  pthread_mutex_unlock(&journal_lock);
+  if (changes) {
+    E.dirty = 1;
+    editorSetStatusMessage("Recovered %d changes from %s", changes, path);
+  }
+}
 void editorSave() {
+  if (E.save) { editorSetStatusMessage("Still saving"); return; }
+  int disk = editorCheckDisk();
+  if (disk == 2 || editorCutShort()) return;
+  if (disk == 1 && !E.disk_overwrite) {
+    E.disk_overwrite = 1;
+    editorSetStatusMessage("%s changed on disk! Ctrl-S again to overwrite it", E.filename);
+    return;
+  }
   if (E.filename == NULL) {
-    E.filename = editorPrompt("Save As: %s (ESC to cancel)", NULL);
+    E.filename = editorPrompt("Save As: %s (ESC to cancel)", NULL, 0);
     if (E.filename == NULL) { editorSetStatusMessage("Save aborted"); return; }
     editorSelectSyntaxHighlight();
   }
-  int len; char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1 && write(fd, buf, len) == len) {
-      close(fd); free(buf); E.dirty = 0;
-      editorSetStatusMessage("%d bytes written to disk", len);
-      return;
+  if (save_wake[0] == -1) {
+    if (pipe(save_wake) == -1) { editorSetStatusMessage("Can't save: %s", strerror(errno)); return; }
+    fcntl(save_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(save_wake[1], F_SETFL, O_NONBLOCK);
+  }
+  E.save = saveSnapshot(E.filename);
+  journalSnapshot();
+  E.save->threaded = pthread_create(&E.save->tid, NULL, saveThread, E.save) == 0;
+  if (!E.save->threaded) saveThread(E.save);
+}
+// The save is over: the buffer is clean if nothing changed since its
+// snapshot was taken.
+void editorSaveFinish() {
+  saveJob *s = E.save;
+  if (s->threaded) pthread_join(s->tid, NULL);
+  E.save = NULL;
+  journalSaved(!s->error);
+  if (s->error) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(s->error));
+  } else {
+    // Spans still read the old file, now unlinked; if the buffer is what
+    // was saved, map the new one instead, once back at the main loop.
+    if (E.changes == s->changes) {
+      E.dirty = 0;
+      if (E.map) { E.remap_size = s->total; E.remap_changes = s->changes; }
     }
-    close(fd);
+    struct stat st;
+    if (stat(E.filename, &st) == 0) editorNoteFile(&st);
+    editorSetStatusMessage("%zu bytes written to disk", s->total);
+  }
+  saveFree(s);
+}
+// Map the file a save wrote, if the buffer is still what was saved and the
+// file still what was written. This rebuilds the row store and re-indexes
+// the file, so it waits for the main loop, where no prompt or search is up;
+// a save started since shares the rows, and remaps when it is done.
+void editorRemap() {
+  size_t size = E.remap_size;
+  E.remap_size = 0;
+  struct stat st;
+  if (!E.map || E.save || E.changes != E.remap_changes || E.find.scan ||
+      stat(E.filename, &st) == -1 || (size_t)st.st_size != size || st.st_ino != E.file_ino)
+    return;
+  editorOpenMapped(E.filename, size);
+}
+// Called by the event loop when the saver made progress or is done.
+void editorSaveIdle() {
+  char drain[64];
+  while (read(save_wake[0], drain, sizeof(drain)) > 0);
+  if (E.save && __atomic_load_n(&E.save->done, __ATOMIC_ACQUIRE)) editorSaveFinish();
+  E.frame_pending = 1;
+}
+// The file grew under follow mode: journal against it as it is now.
+void journalRebase() {
+  journal *j = &E.journal;
+  pthread_mutex_lock(&journal_lock);
+  pthread_mutex_lock(&journal_io);
+  journalBase(&j->base, E.filename);
+  if (j->fd != -1 && pwrite(j->fd, &j->base, sizeof(j->base), 0) == -1) { /* kept */ }
+  pthread_mutex_unlock(&journal_io);
+  pthread_mutex_unlock(&journal_lock);
+}
+// Append text read from the end of the followed file as rows, the first
+// line continuing the last row if the file didn't end in a newline. Rows
+// already there are left alone but for that one, and none of it is an
+// edit: it isn't journaled, recorded for undo or counted as a change.
+void editorFollowAppend(const char *text, size_t len, int partial) {
+  size_t at = 0;
+  if (partial && E.numrows) {
+    int view = E.view; E.view = 0;
+    erow *row = editorRow(E.numrows - 1);
+    E.view = view;
+    const char *nl = memchr(text, '\n', len);
+    size_t n = nl ? (size_t)(nl - text) : len;
+    at = nl ? n + 1 : len;
+    if (nl) while (n && text[n - 1] == '\r') n--;
+    editorRowUnshare(row);
+    row->chars = realloc(row->chars, row->size + n + 1);
+    memcpy(&row->chars[row->size], text, n);
+    row->size += n; row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+  }
+  rowNode *first = NULL, *last = NULL;
+  int lines = 0;
+  while (at < len) {
+    const char *nl = memchr(&text[at], '\n', len - at);
+    size_t n = nl ? (size_t)(nl - &text[at]) : len - at;
+    rowNode *node = rowNodeNew(1, -1);
+    node->row.chars = malloc(n + 1);
+    memcpy(node->row.chars, &text[at], n);
+    at += nl ? n + 1 : n;
+    if (nl) while (n && node->row.chars[n - 1] == '\r') n--;
+    node->row.size = n; node->row.chars[n] = '\0';
+    node->prev = last;
+    if (last) last->next = node; else first = node;
+    last = node; lines++;
+  }
+  if (!lines) return;
+  rowNode *tail = E.rows;
+  while (tail && tail->right) tail = tail->right;
+  rowNode *added = rowTreeBuild(first, lines);
+  pthread_rwlock_wrlock(&rows_lock);
+  if (tail) { tail->next = first; first->prev = tail; }
+  rowTreeSetRoot(rowTreeMerge(E.rows, added));
+  E.numrows += lines;
+  pthread_rwlock_unlock(&rows_lock);
+}
+int editorFollowStart() {
+  follow *f = &E.follow;
+  struct stat st;
+  int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -1;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) { close(fd); errno = EINVAL; return -1; }
+  int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (ifd == -1 || inotify_add_watch(ifd, E.filename, IN_MODIFY | IN_ATTRIB |
+                                     IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+    int saved = errno;
+    if (ifd != -1) close(ifd);
+    close(fd); errno = saved;
+    return -1;
+  }
+  // Watch the directory too, for a new file taking the name.
+  char *slash = strrchr(E.filename, '/');
+  char dir[slash ? slash - E.filename + 2 : 2];
+  snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - E.filename) + 1 : 1,
+           slash ? E.filename : ".");
+  inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO);
+  f->ifd = ifd; f->fd = fd; f->size = E.file_size; f->pending = 0;
+  return 0;
+}
+void editorFollowStop() {
+  follow *f = &E.follow;
+  if (f->ifd == -1) return;
+  close(f->ifd); close(f->fd);
+  f->ifd = f->fd = -1; f->pending = 0;
+}
+// Load a file from scratch in place of the buffer, dropping the undo
+// history, and recover its journal if it left one.
+void editorLoad(const char *filename) {
+  char *name = strdup(filename);
+  journalDiscard();
+  while (E.undo_first) undoFreeChunk(E.undo_first);
+  E.undo_open = 0;
+  editorClearSelection();
+  rowTreeFree(E.rows); rowTreeSetRoot(NULL);
+  E.numrows = 0; E.hl_valid = 0;
+  if (E.map) munmap(E.map, E.map_size);
+  free(E.line_off);
+  E.map = NULL; E.map_size = 0; E.line_off = NULL; E.remap_size = 0;
+  editorOpen(name);
+  free(name);
+  journalRecover();
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  E.cx = 0;
+}
+// The followed file was truncated or replaced: load it again and go on
+// following it.
+void editorFollowReload(const char *why) {
+  editorFollowStop();
+  editorLoad(E.filename);
+  E.cy = E.numrows ? E.numrows - 1 : 0; E.cx = 0;
+  if (editorFollowStart() == -1)
+    editorSetStatusMessage("%s was %s; stopped following: %s", E.filename, why, strerror(errno));
+  else
+    editorSetStatusMessage("%s was %s; loaded it again", E.filename, why);
+}
+// Bring the rows up to date with the followed file: append up to
+// FOLLOW_BATCH bytes written past what they hold, or load the file again
+// if it shrank or, once it is read to the end, another file took its name.
+// A cursor on the last row stays on the last row.
+void editorFollowCheck() {
+  follow *f = &E.follow;
+  struct stat st, now;
+  f->pending = 0;
+  E.frame_pending = 1;
+  if (fstat(f->fd, &st) == -1) return;
+  if (st.st_size < f->size) { editorFollowReload("truncated"); return; }
+  if (st.st_size == f->size) {
+    if (stat(E.filename, &now) == 0 && (now.st_ino != st.st_ino || now.st_dev != st.st_dev))
+      editorFollowReload("replaced");
+    return;
+  }
+  size_t want = st.st_size - f->size;
+  if (want > FOLLOW_BATCH) want = FOLLOW_BATCH;
+  char *buf = malloc(want);
+  ssize_t got = pread(f->fd, buf, want, f->size);
+  char c;
+  int partial = f->size > 0 && pread(f->fd, &c, 1, f->size - 1) == 1 && c != '\n';
+  if (got > 0) {
+    int old = E.numrows, bottom = E.cy >= E.numrows - 1;
+    editorFollowAppend(buf, got, partial);
+    f->size += got;
+    if (bottom && E.numrows > old) { E.cy = E.numrows - 1; E.cx = 0; }
+    editorNoteFile(&st);
+    E.file_size = f->size;
+    journalRebase();
+    f->pending = f->size < st.st_size;
   }
   free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1, direction = 1, saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl); saved_hl = NULL;
-  }
-  if (key == '\r' || key == '\x1b') { last_match = -1; direction = 1; return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) { direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) { direction = -1;
-  } else { last_match = -1; direction = 1; }
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  for (int i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current; E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+// Called by the event loop on inotify events and while a check left more
+// to read.
+void editorFollowIdle() {
+  char events[4096];
+  while (read(E.follow.ifd, events, sizeof(events)) > 0);
+  editorFollowCheck();
+}
+void editorFollowToggle() {
+  if (E.follow.ifd != -1) {
+    editorFollowStop();
+    editorSetStatusMessage("Stopped following %s", E.filename);
+    return;
+  }
+  if (!E.filename) { editorSetStatusMessage("Nothing to follow"); return; }
+  if (editorFollowStart() == -1) {
+    editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+    return;
+  }
+  editorSetStatusMessage("Following %s (Ctrl-T to stop)", E.filename);
+  E.cy = E.numrows ? E.numrows - 1 : 0; E.cx = 0;
+  editorFollowCheck();
+}
+// Outside changes: the file is stat'ed on keys, at most once every
+// DISK_CHECK_MS, and before saving. When it changed and the buffer has no
+// unsaved changes, the new version is diffed line by line against the rows
+// and only the lines that differ are replaced, as undoable edits, so the
+// cursor, the undo history and the highlighting of the rest are kept.
+typedef struct diffLine { const char *text; int len; unsigned hash; } diffLine;
+typedef struct diffHunk { int a, n, b, m; } diffHunk;  // A[a, a+n) -> B[b, b+m)
+diffLine diffLineOf(const char *text, int len) {
+  return (diffLine){ text, len, journalSum(text, len) };
+}
+int diffEqual(diffLine *x, diffLine *y) {
+  return x->hash == y->hash && x->len == y->len && !memcmp(x->text, y->text, x->len);
+}
+// Line `line` of a mapped file indexed by off, without its terminator.
+diffLine diffMappedLine(const char *map, size_t *off, int line) {
+  size_t start = off[line], end = off[line + 1] - 1;
+  while (end > start && map[end - 1] == '\r') end--;
+  return diffLineOf(&map[start], end - start);
+}
+diffLine diffRowLine(rowNode *node, int off) {
+  int len; const char *text;
+  if (node->src >= 0) text = editorMappedLine(node->src + off, &len);
+  else { text = node->row.chars; len = node->row.size; }
+  return diffLineOf(text, len);
+}
+// Myers' greedy diff of A (n lines) and B (m lines): the hunks between
+// the common runs of a shortest edit script, or one hunk replacing all of
+// A if that takes more than DIFF_MAX_EDITS edits. Returns the hunk count.
+int diffLines(diffLine *A, int n, diffLine *B, int m, diffHunk **out) {
+  int maxd = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS, d, found = -1;
+  // V for edit count d is kept at v[d * d + d + k] for k in [-d, d].
+#define DIFF_V(d, k) v[(d) * (d) + (d) + (k)]
+  int *v = malloc(sizeof(int) * (maxd + 1) * (maxd + 1));
+  for (d = 0; d <= maxd && found < 0; d++) {
+    for (int k = -d; k <= d; k += 2) {
+      int x;
+      if (d == 0) x = 0;
+      else if (k == -d || (k != d && DIFF_V(d - 1, k - 1) < DIFF_V(d - 1, k + 1)))
+        x = DIFF_V(d - 1, k + 1);
+      else x = DIFF_V(d - 1, k - 1) + 1;
+      int y = x - k;
+      while (x < n && y < m && diffEqual(&A[x], &B[y])) x++, y++;
+      DIFF_V(d, k) = x;
+      if (x >= n && y >= m) { found = d; break; }
+    }
+  }
+  diffHunk *h = malloc(sizeof(diffHunk) * (found < 0 ? 1 : found + 1));
+  int nh = 0;
+  if (found < 0) {
+    h[nh++] = (diffHunk){ 0, n, 0, m };
+  } else {
+    // Walk back from (n, m). Each edit d is a step from (px, py) to
+    // (mx, my) and a run of equal lines on to (x, y); the lines between two
+    // runs make a hunk, so hunks come out last first.
+    int x = n, y = m, gx = n, gy = m;
+    for (d = found; d >= 0; d--) {
+      int px = 0, py = 0, mx = 0, my = 0;
+      if (d) {
+        int k = x - y;
+        int down = k == -d || (k != d && DIFF_V(d - 1, k - 1) < DIFF_V(d - 1, k + 1));
+        px = DIFF_V(d - 1, down ? k + 1 : k - 1);
+        py = px - (down ? k + 1 : k - 1);
+        mx = down ? px : px + 1; my = down ? py + 1 : py;
+      }
+      if (mx < x) {
+        if (x < gx || y < gy) h[nh++] = (diffHunk){ x, gx - x, y, gy - y };
+        gx = mx; gy = my;
+      }
+      x = px; y = py;
     }
+    if (gx > 0 || gy > 0) h[nh++] = (diffHunk){ 0, gx, 0, gy };
+    for (int j = 0; j < nh / 2; j++) { diffHunk t = h[j]; h[j] = h[nh - 1 - j]; h[nh - 1 - j] = t; }
+  }
+#undef DIFF_V
+  free(v);
+  *out = h;
+  return nh;
+}
+// Delete from (cy, cx) to (end_cy, end_cx) as an undoable edit.
+void editorDiffDelete(int cy, int cx, int end_cy, int end_cx) {
+  int len = editorCopyRange(cy, cx, end_cy, end_cx, NULL);
+  undoRecord *r = undoAlloc(UNDO_DELETE_SELECTION, cy, cx, len, 0, 0);
+  editorCopyRange(cy, cx, end_cy, end_cx, undoText(r));
+  editorDeleteRange(cy, cx, end_cy, end_cx);
+}
+// Replace rows [h->a, h->a + h->n) with the lines B[h->b, h->b + h->m),
+// as a delete and an insert that undo can take back. The text edited is
+// cut at the start of a row when a row follows the hunk, and otherwise at
+// the end of the row before it, so no other row changes.
+void editorDiffApply(diffHunk *h, diffLine *B) {
+  int a = h->a, tail = a + h->n == E.numrows, anchor = tail && a > 0;
+  int cy = anchor ? a - 1 : a, cx = anchor ? editorRow(a - 1)->size : 0;
+  if (h->n && tail && !a && !h->m) {
+    // Every row goes: a range would leave an empty one behind.
+    int last = E.numrows - 1, end_cx = editorRow(last)->size;
+    int len = editorCopyRange(0, 0, last, end_cx, NULL);
+    undoRecord *r = undoAlloc(UNDO_DELETE_LINES, 0, 0, len, 0, 0);
+    editorCopyRange(0, 0, last, end_cx, undoText(r));
+    editorDelRows(0, E.numrows);
+    return;
   }
+  if (h->n) {
+    if (!tail) editorDiffDelete(a, 0, a + h->n, 0);
+    else editorDiffDelete(cy, cx, E.numrows - 1, editorRow(E.numrows - 1)->size);
+  }
+  if (!h->m) return;
+  int len = 0;
+  for (int j = 0; j < h->m; j++) len += B[h->b + j].len + 1;
+  char *text = malloc(len), *p = text;
+  for (int j = 0; j < h->m; j++) {
+    if (anchor) *p++ = '\n';
+    editorMapCopy(p, B[h->b + j].text, B[h->b + j].len);
+    p += B[h->b + j].len;
+    if (!tail) *p++ = '\n';
+    else if (!anchor && j < h->m - 1) *p++ = '\n';
+  }
+  len = p - text;
+  if (!E.numrows) {
+    undoPush(UNDO_INSERT_LINES, 0, 0, text, len);
+    editorInsertLines(0, text, len);
+  } else {
+    undoPush(UNDO_INSERT_TEXT, cy, cx, text, len);
+    editorInsertText(cy, cx, text, len);
+  }
+  free(text);
 }
-void editorFind() {
+// The file, as st, changed on disk and the buffer has no unsaved changes:
+// diff the rows against it and replace the lines that differ, as one step
+// that undo takes back. Spans are diffed as they read now: a file rewritten
+// in place has changed under them too, up to its new end (editorMapCut).
+// The new file is mapped and indexed once, and spans left over read it.
+void editorReloadDiff(struct stat *st) {
+  int fd = open(E.filename, O_RDONLY);
+  char *map = NULL; size_t *off = NULL; int lines = 0;
+  if (fd != -1 && st->st_size > 0) {
+    map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) map = NULL;
+    else lines = editorIndexLines(map, st->st_size, &off);
+  }
+  if (fd != -1) close(fd);
+  if (fd == -1 || (st->st_size > 0 && !map)) {
+    editorSetStatusMessage("%s changed on disk; can't read it: %s", E.filename, strerror(errno));
+    return;
+  }
+  // Either file may be cut short while it is read; the next check tries
+  // again.
+  diffLine *volatile A = NULL, *volatile B = NULL;
+  sigjmp_buf jb, *outer = map_guard;
+  if (sigsetjmp(jb, 0)) {
+    map_guard = outer;
+    free(A); free(B);
+    if (map) { munmap(map, st->st_size); free(off); }
+    return;
+  }
+  map_guard = &jb;
+  // Most changes leave the start and the end alone; diff only the middle.
+  int rows = E.numrows, pre = 0, suf = 0, o = 0;
+  rowNode *node = rowTreeFirst();
+  while (pre < rows && pre < lines) {
+    diffLine x = diffRowLine(node, o), y = diffMappedLine(map, off, pre);
+    if (!diffEqual(&x, &y)) break;
+    pre++;
+    if (++o == node->lines) { node = node->next; o = 0; }
+  }
+  node = E.rows;
+  while (node && node->right) node = node->right;
+  o = node ? node->lines - 1 : 0;
+  while (suf < rows - pre && suf < lines - pre) {
+    diffLine x = diffRowLine(node, o), y = diffMappedLine(map, off, lines - 1 - suf);
+    if (!diffEqual(&x, &y)) break;
+    suf++;
+    if (o-- == 0 && (node = node->prev)) o = node->lines - 1;
+  }
+  int n = rows - pre - suf, m = lines - pre - suf;
+  A = malloc(sizeof(diffLine) * (n + 1)); B = malloc(sizeof(diffLine) * (m + 1));
+  if (n) node = rowTreeAt(pre, &o);
+  for (int j = 0; j < n; j++) {
+    A[j] = diffRowLine(node, o);
+    if (++o == node->lines) { node = node->next; o = 0; }
+  }
+  for (int j = 0; j < m; j++) B[j] = diffMappedLine(map, off, pre + j);
+  map_guard = outer;
+  diffHunk *h = NULL;
+  int nh = n || m ? diffLines(A, n, B, m, &h) : 0, changed = 0;
+  // Apply the hunks last first, so rows above each stay where they were,
+  // keeping the cursor and the screen on the same lines.
+  int view = E.view;
+  E.view = 0; E.undo_reload = 1;
+  for (int j = nh - 1; j >= 0; j--) {
+    diffHunk *k = &h[j];
+    k->a += pre;
+    editorDiffApply(k, B);
+    int end = k->a + k->n, shift = k->m - k->n;
+    if (E.cy >= end) E.cy += shift;
+    else if (E.cy >= k->a) E.cy = k->a + (E.cy - k->a < k->m ? E.cy - k->a : 0);
+    if (E.rowoff > k->a) E.rowoff = E.rowoff >= end ? E.rowoff + shift : k->a;
+    changed += k->n > k->m ? k->n : k->m;
+  }
+  E.view = view; E.undo_reload = 0;
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  if (E.cy < E.numrows && E.cx > editorRow(E.cy)->size) E.cx = editorRow(E.cy)->size;
+  editorClearSelection();
+  free(A); free(B); free(h);
+  // Spans still read the old file. The rows now match the new one line for
+  // line, so a span at row r reads from line r of it.
+  if (E.map) {
+    pthread_rwlock_wrlock(&rows_lock);
+    int row = 0;
+    for (rowNode *node = rowTreeFirst(); node; node = node->next) {
+      if (node->src >= 0) node->src = row;
+      row += node->lines;
+    }
+    munmap(E.map, E.map_size); free(E.line_off);
+    E.map = map; E.map_size = E.map_avail = st->st_size; E.line_off = off;
+    E.map_ino = st->st_ino;
+    pthread_rwlock_unlock(&rows_lock);
+    if (map) madvise(map, st->st_size, MADV_RANDOM);
+    editorViewReset();
+  } else if (map) {
+    munmap(map, st->st_size); free(off);
+  }
+  E.dirty = 0;
+  editorNoteFile(st);
+  journalStart();
+  editorSetStatusMessage("%s changed on disk; reloaded %d line%s", E.filename,
+                         changed, changed == 1 ? "" : "s");
+}
+// Whether the file changed on disk since the rows last matched it.
+int editorDiskChanged(struct stat *st) {
+  if (!E.filename || stat(E.filename, st) == -1) return 0;
+  return st->st_size != E.file_size || st->st_ino != E.file_ino ||
+         st->st_mtim.tv_sec != E.file_mtime.tv_sec ||
+         st->st_mtim.tv_nsec != E.file_mtime.tv_nsec;
+}
+// Look for outside changes, reloading them when the buffer has no unsaved
+// changes. Follow mode and a running save keep the rows in step with the
+// file themselves. Returns 0 if the rows match the file, 1 if it changed
+// under unsaved changes, 2 if it was reloaded.
+int editorCheckDisk() {
+  struct stat st;
+  E.disk_checked = editorNow();
+  if (E.save || E.follow.ifd != -1 || !editorDiskChanged(&st)) return 0;
+  editorMapCut(&st);
+  if (!E.dirty) { editorReloadDiff(&st); return 2; }
+  if (editorCutShort()) { E.disk_warned = 1; return 1; }
+  if (!E.disk_warned)
+    editorSetStatusMessage("%s changed on disk! Saving will overwrite it", E.filename);
+  E.disk_warned = 1;
+  return 1;
+}
+// Substring kernels: the first occurrence of q (qlen >= 1) in hay, or NULL.
+// The vector ones compare the first and the last byte of the query against
+// 16 or 32 candidate positions at once and only verify where both agree.
+typedef const char *(*findKernel)(const char *hay, size_t len, const char *q, size_t qlen);
+const char *findScalar(const char *hay, size_t len, const char *q, size_t qlen) {
+  return memmem(hay, len, q, qlen);
+}
+#ifdef __SSE2__
+const char *findSSE2(const char *hay, size_t len, const char *q, size_t qlen) {
+  __m128i first = _mm_set1_epi8(q[0]), last = _mm_set1_epi8(q[qlen - 1]);
+  size_t i = 0;
+  for (; i + qlen - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + qlen - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      const char *p = hay + i + __builtin_ctz(mask);
+      if (qlen < 3 || !memcmp(p + 1, q + 1, qlen - 2)) return p;
+      mask &= mask - 1;
+    }
+  }
+  return i < len ? findScalar(hay + i, len - i, q, qlen) : NULL;
+}
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+const char *findAVX2(const char *hay, size_t len, const char *q, size_t qlen) {
+  __m256i first = _mm256_set1_epi8(q[0]), last = _mm256_set1_epi8(q[qlen - 1]);
+  size_t i = 0;
+  for (; i + qlen - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + qlen - 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      const char *p = hay + i + __builtin_ctz(mask);
+      if (qlen < 3 || !memcmp(p + 1, q + 1, qlen - 2)) return p;
+      mask &= mask - 1;
+    }
+  }
+  return i < len ? findScalar(hay + i, len - i, q, qlen) : NULL;
+}
+#endif
+findKernel editorFindKernel() {
+  static findKernel kernel = NULL;
+  if (kernel) return kernel;
+  kernel = findScalar;
+#ifdef __SSE2__
+  kernel = findSSE2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) kernel = findAVX2;
+#endif
+  return kernel;
+}
+// Regular expressions for regex search. A pattern is parsed into a tree,
+// compiled to a Thompson NFA both forwards and reversed, and run as DFAs
+// built lazily, a state and a transition at a time, as the text needs them.
+// Supported: literals, ., [classes], \d \w \s \D \W \S, ^ and $ (which match
+// at the ends of a line), groups, |, * + and ?.
+#define REGEX_MAX_STATES 1024  // DFA states cached before the cache is flushed
+enum regexOp { RE_SET, RE_CAT, RE_ALT, RE_STAR, RE_PLUS, RE_QUEST, RE_BOL, RE_EOL, RE_EMPTY };
+typedef struct regexNode { int op, set, left, right; } regexNode;
+enum nfaOp { NFA_SET, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+typedef struct nfaState { int op, set, out, out1; } nfaState;
+typedef struct regexNFA { nfaState *s; int n, cap, start; } regexNFA;
+struct regex {
+  unsigned char (*set)[32]; int nsets;  // Byte sets, one bit per byte
+  regexNode *node; int nnodes;
+  regexNFA fwd, rev;  // rev matches the text read backwards, ^ and $ swapped
+};
+typedef struct regexParser { const char *p; const char *error; regex *re; } regexParser;
+int regexNewSet(regex *re) {
+  re->set = realloc(re->set, sizeof(*re->set) * (re->nsets + 1));
+  memset(re->set[re->nsets], 0, sizeof(*re->set));
+  return re->nsets++;
+}
+void regexSetAdd(regex *re, int set, int from, int to) {
+  for (int c = from; c <= to; c++) re->set[set][c >> 3] |= 1 << (c & 7);
+}
+int regexNewNode(regex *re, int op, int set, int left, int right) {
+  re->node = realloc(re->node, sizeof(regexNode) * (re->nnodes + 1));
+  re->node[re->nnodes] = (regexNode){op, set, left, right};
+  return re->nnodes++;
+}
+// Add the class named by \c to set; 0 if c names none.
+int regexClassEscape(regex *re, int set, int c) {
+  int lower = tolower(c);
+  if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+  int tmp = regexNewSet(re);
+  if (lower == 'd') regexSetAdd(re, tmp, '0', '9');
+  if (lower == 'w') {
+    regexSetAdd(re, tmp, '0', '9'); regexSetAdd(re, tmp, 'a', 'z');
+    regexSetAdd(re, tmp, 'A', 'Z'); regexSetAdd(re, tmp, '_', '_');
+  }
+  if (lower == 's') { regexSetAdd(re, tmp, '\t', '\r'); regexSetAdd(re, tmp, ' ', ' '); }
+  for (int j = 0; j < 32; j++)
+    re->set[set][j] |= c == lower ? re->set[tmp][j] : (unsigned char)~re->set[tmp][j];
+  re->nsets--;
+  return 1;
+}
+int regexEscapeChar(int c) {
+  return c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+}
+int regexParseClass(regexParser *ps) {
+  regex *re = ps->re;
+  int set = regexNewSet(re), negate = 0;
+  if (*ps->p == '^') { negate = 1; ps->p++; }
+  const char *first = ps->p;
+  while (*ps->p != ']' || ps->p == first) {
+    if (!*ps->p) { ps->error = "missing ]"; return -1; }
+    int c = (unsigned char)*ps->p++;
+    if (c == '\\') {
+      if (!*ps->p) { ps->error = "trailing \\"; return -1; }
+      c = (unsigned char)*ps->p++;
+      if (regexClassEscape(re, set, c)) continue;
+      c = regexEscapeChar(c);
+    }
+    int to = c;
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      to = (unsigned char)ps->p[1]; ps->p += 2;
+      if (to == '\\' && *ps->p) to = regexEscapeChar((unsigned char)*ps->p++);
+      if (to < c) { ps->error = "bad range"; return -1; }
+    }
+    regexSetAdd(re, set, c, to);
+  }
+  ps->p++;
+  if (negate) for (int j = 0; j < 32; j++) re->set[set][j] = ~re->set[set][j];
+  re->set[set]['\n' >> 3] &= ~(1 << ('\n' & 7));
+  return regexNewNode(re, RE_SET, set, -1, -1);
+}
+int regexParseAlt(regexParser *ps);
+int regexParseAtom(regexParser *ps) {
+  regex *re = ps->re;
+  int c = (unsigned char)*ps->p++, set;
+  switch (c) {
+  case '(': {
+    int n = regexParseAlt(ps);
+    if (n < 0) return -1;
+    if (*ps->p != ')') { ps->error = "missing )"; return -1; }
+    ps->p++;
+    return n;
+  }
+  case '[': return regexParseClass(ps);
+  case '^': return regexNewNode(re, RE_BOL, -1, -1, -1);
+  case '$': return regexNewNode(re, RE_EOL, -1, -1, -1);
+  case '*': case '+': case '?': ps->error = "nothing to repeat"; return -1;
+  case '.':
+    set = regexNewSet(re);
+    regexSetAdd(re, set, 0, 255);
+    re->set[set]['\n' >> 3] &= ~(1 << ('\n' & 7));
+    return regexNewNode(re, RE_SET, set, -1, -1);
+  case '\\':
+    if (!*ps->p) { ps->error = "trailing \\"; return -1; }
+    c = (unsigned char)*ps->p++;
+    set = regexNewSet(re);
+    if (!regexClassEscape(re, set, c)) { c = regexEscapeChar(c); regexSetAdd(re, set, c, c); }
+    return regexNewNode(re, RE_SET, set, -1, -1);
+  default:
+    set = regexNewSet(re);
+    regexSetAdd(re, set, c, c);
+    return regexNewNode(re, RE_SET, set, -1, -1);
+  }
+}
+int regexParseRepeat(regexParser *ps) {
+  int n = regexParseAtom(ps);
+  while (n >= 0 && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+    int op = *ps->p == '*' ? RE_STAR : *ps->p == '+' ? RE_PLUS : RE_QUEST;
+    ps->p++;
+    n = regexNewNode(ps->re, op, -1, n, -1);
+  }
+  return n;
+}
+int regexParseCat(regexParser *ps) {
+  int n = -1;
+  while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+    int atom = regexParseRepeat(ps);
+    if (atom < 0) return -1;
+    n = n < 0 ? atom : regexNewNode(ps->re, RE_CAT, -1, n, atom);
+  }
+  return n < 0 ? regexNewNode(ps->re, RE_EMPTY, -1, -1, -1) : n;
+}
+int regexParseAlt(regexParser *ps) {
+  int n = regexParseCat(ps);
+  while (n >= 0 && *ps->p == '|') {
+    ps->p++;
+    int right = regexParseCat(ps);
+    if (right < 0) return -1;
+    n = regexNewNode(ps->re, RE_ALT, -1, n, right);
+  }
+  return n;
+}
+int nfaNew(regexNFA *nfa, int op, int set, int out, int out1) {
+  if (nfa->n == nfa->cap) {
+    nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+    nfa->s = realloc(nfa->s, sizeof(nfaState) * nfa->cap);
+  }
+  nfa->s[nfa->n] = (nfaState){op, set, out, out1};
+  return nfa->n++;
+}
+// Compile a tree node into states that lead to next; returns its entry.
+int regexCompileNode(regex *re, regexNFA *nfa, int id, int next, int reverse) {
+  regexNode node = re->node[id];
+  int split, body;
+  switch (node.op) {
+  case RE_SET: return nfaNew(nfa, NFA_SET, node.set, next, -1);
+  case RE_CAT:
+    if (reverse) return regexCompileNode(re, nfa, node.right,
+                                         regexCompileNode(re, nfa, node.left, next, 1), 1);
+    return regexCompileNode(re, nfa, node.left,
+                            regexCompileNode(re, nfa, node.right, next, 0), 0);
+  case RE_ALT:
+    body = regexCompileNode(re, nfa, node.left, next, reverse);
+    return nfaNew(nfa, NFA_SPLIT, -1, body, regexCompileNode(re, nfa, node.right, next, reverse));
+  case RE_STAR: case RE_PLUS:
+    split = nfaNew(nfa, NFA_SPLIT, -1, -1, next);
+    body = regexCompileNode(re, nfa, node.left, split, reverse);
+    nfa->s[split].out = body;
+    return node.op == RE_STAR ? split : body;
+  case RE_QUEST:
+    body = regexCompileNode(re, nfa, node.left, next, reverse);
+    return nfaNew(nfa, NFA_SPLIT, -1, body, next);
+  case RE_BOL: return nfaNew(nfa, reverse ? NFA_EOL : NFA_BOL, -1, next, -1);
+  case RE_EOL: return nfaNew(nfa, reverse ? NFA_BOL : NFA_EOL, -1, next, -1);
+  default: return next;
+  }
+}
+void regexFree(regex *re) {
+  if (!re) return;
+  free(re->set); free(re->node); free(re->fwd.s); free(re->rev.s); free(re);
+}
+// Compile pattern; on a syntax error return NULL and point *error at why.
+regex *regexCompile(const char *pattern, const char **error) {
+  regex *re = calloc(1, sizeof(regex));
+  regexParser ps = { pattern, NULL, re };
+  int root = regexParseAlt(&ps);
+  if (root >= 0 && *ps.p == ')') ps.error = "unmatched )";
+  if (ps.error) { *error = ps.error; regexFree(re); return NULL; }
+  re->fwd.start = regexCompileNode(re, &re->fwd, root, nfaNew(&re->fwd, NFA_MATCH, -1, -1, -1), 0);
+  re->rev.start = regexCompileNode(re, &re->rev, root, nfaNew(&re->rev, NFA_MATCH, -1, -1, -1), 1);
+  return re;
+}
+// A DFA state is the set of NFA states (those that consume a byte, wait on
+// $ or match) the NFA can be in. Unanchored DFAs start a new NFA thread at
+// every position, so they find matches that start anywhere.
+typedef struct dfaState {
+  int *set, nset;
+  int accept, accept_eol;  // Matches here; matches here if at the end of the line
+  struct dfaState *next[256];  // State after a byte, or NULL if not built yet
+} dfaState;
+typedef struct regexDFA {
+  regex *re; regexNFA *nfa; int unanchored;
+  dfaState **state; int nstates, flushes;
+  int *hash; int hash_cap;  // State indices by set, -1 for empty slots
+  dfaState *start[2];       // Start state at the start of the line (1) or not (0)
+  int *list, *stack; unsigned int *mark, gen;  // Closure scratch, per NFA state
+} regexDFA;
+struct regexMatcher {
+  regexDFA fwd, rev;
+  int *starts; int nstarts, starts_cap;
+  int *threads;              // NFA state and match end lists for regexScanLongest
+  int *longest; int longest_cap;  // Longest match end per start, -1 for none
+};
+void dfaNextGen(regexDFA *d) {
+  if (++d->gen == 0) { memset(d->mark, 0, sizeof(unsigned int) * d->nfa->n); d->gen = 1; }
+}
+// Add the states reachable from s without consuming a byte to out,
+// passing ^ only if bol and $ only if eol.
+void dfaClosure(regexDFA *d, int s, int bol, int eol, int *out, int *n) {
+  int sp = 0;
+  d->stack[sp++] = s;
+  while (sp) {
+    int x = d->stack[--sp];
+    if (x < 0 || d->mark[x] == d->gen) continue;
+    d->mark[x] = d->gen;
+    nfaState *st = &d->nfa->s[x];
+    if (st->op == NFA_SPLIT) { d->stack[sp++] = st->out1; d->stack[sp++] = st->out; }
+    else if (st->op == NFA_BOL) { if (bol) d->stack[sp++] = st->out; }
+    else if (st->op == NFA_EOL && eol) d->stack[sp++] = st->out;
+    else out[(*n)++] = x;
+  }
+}
+unsigned int dfaHash(const int *set, int n) {
+  unsigned int h = 2166136261u;
+  for (int j = 0; j < n; j++) h = (h ^ set[j]) * 16777619u;
+  return h;
+}
+int dfaCompareInt(const void *a, const void *b) { return *(const int *)a - *(const int *)b; }
+void dfaFlush(regexDFA *d) {
+  for (int j = 0; j < d->nstates; j++) { free(d->state[j]->set); free(d->state[j]); }
+  d->nstates = 0; d->flushes++;
+  d->start[0] = d->start[1] = NULL;
+  for (int j = 0; j < d->hash_cap; j++) d->hash[j] = -1;
+}
+// The state for the n NFA states in d->list, made if it isn't cached.
+dfaState *dfaIntern(regexDFA *d, int n) {
+  qsort(d->list, n, sizeof(int), dfaCompareInt);
+  unsigned int h = dfaHash(d->list, n) & (d->hash_cap - 1);
+  for (; d->hash[h] != -1; h = (h + 1) & (d->hash_cap - 1)) {
+    dfaState *st = d->state[d->hash[h]];
+    if (st->nset == n && !memcmp(st->set, d->list, sizeof(int) * n)) return st;
+  }
+  if (d->nstates == REGEX_MAX_STATES) {
+    dfaFlush(d);
+    h = dfaHash(d->list, n) & (d->hash_cap - 1);
+  }
+  dfaState *st = malloc(sizeof(dfaState));
+  st->set = malloc(sizeof(int) * (n ? n : 1)); st->nset = n;
+  memcpy(st->set, d->list, sizeof(int) * n);
+  st->accept = st->accept_eol = 0;
+  for (int j = 0; j < 256; j++) st->next[j] = NULL;
+  int eols = 0;
+  dfaNextGen(d);
+  for (int j = 0; j < n; j++) {
+    int op = d->nfa->s[st->set[j]].op;
+    if (op == NFA_MATCH) st->accept = st->accept_eol = 1;
+    if (op == NFA_EOL) dfaClosure(d, d->nfa->s[st->set[j]].out, 0, 1, d->list, &eols);
+  }
+  for (int j = 0; j < eols; j++)
+    if (d->nfa->s[d->list[j]].op == NFA_MATCH) st->accept_eol = 1;
+  d->hash[h] = d->nstates;
+  d->state[d->nstates++] = st;
+  return st;
+}
+dfaState *dfaStart(regexDFA *d, int bol) {
+  if (!d->start[bol]) {
+    int n = 0;
+    dfaNextGen(d);
+    dfaClosure(d, d->nfa->start, bol, 0, d->list, &n);
+    dfaState *st = dfaIntern(d, n);
+    d->start[bol] = st;
+  }
+  return d->start[bol];
+}
+// Build the transition from st on byte c. A flush frees st, so callers
+// must only use the state returned.
+dfaState *dfaStep(regexDFA *d, dfaState *st, unsigned char c) {
+  int n = 0;
+  dfaNextGen(d);
+  for (int j = 0; j < st->nset; j++) {
+    nfaState *ns = &d->nfa->s[st->set[j]];
+    if (ns->op == NFA_SET && d->re->set[ns->set][c >> 3] & (1 << (c & 7)))
+      dfaClosure(d, ns->out, 0, 0, d->list, &n);
+  }
+  if (d->unanchored) dfaClosure(d, d->nfa->start, 0, 0, d->list, &n);
+  int flushes = d->flushes;
+  dfaState *next = dfaIntern(d, n);
+  if (d->flushes == flushes) st->next[c] = next;
+  return next;
+}
+void dfaInit(regexDFA *d, regex *re, regexNFA *nfa, int unanchored) {
+  memset(d, 0, sizeof(*d));
+  d->re = re; d->nfa = nfa; d->unanchored = unanchored;
+  d->state = malloc(sizeof(dfaState *) * REGEX_MAX_STATES);
+  d->hash_cap = REGEX_MAX_STATES * 2;
+  d->hash = malloc(sizeof(int) * d->hash_cap);
+  d->list = malloc(sizeof(int) * nfa->n);
+  d->stack = malloc(sizeof(int) * (2 * nfa->n + 1));
+  d->mark = calloc(nfa->n, sizeof(unsigned int));
+  dfaFlush(d);
+  d->flushes = 0;
+}
+void dfaFree(regexDFA *d) {
+  dfaFlush(d);
+  free(d->state); free(d->hash); free(d->list); free(d->stack); free(d->mark);
+}
+// Matchers hold the DFA caches, so each thread matching needs its own.
+regexMatcher *regexMatcherNew(regex *re) {
+  regexMatcher *m = calloc(1, sizeof(regexMatcher));
+  dfaInit(&m->fwd, re, &re->fwd, 0);
+  dfaInit(&m->rev, re, &re->rev, 1);
+  return m;
+}
+void regexMatcherFree(regexMatcher *m) {
+  if (!m) return;
+  dfaFree(&m->fwd); dfaFree(&m->rev);
+  free(m->starts); free(m->threads); free(m->longest); free(m);
+}
+void findPush(findVec *v, int row, int col, int len);
+void regexPushStart(regexMatcher *m, int p) {
+  if (m->nstarts == m->starts_cap) {
+    m->starts_cap = m->starts_cap ? m->starts_cap * 2 : 64;
+    m->starts = realloc(m->starts, sizeof(int) * m->starts_cap);
+  }
+  m->starts[m->nstarts++] = p;
+}
+// The longest match at every start in the line, from one backward run of
+// the reversed NFA. Each thread carries the end of the match it would be
+// part of; where threads meet in a state only the one with the furthest
+// end goes on, as the rest can't start anything it doesn't. Threads are
+// kept in order of end, so the first to reach a state is that one.
+void regexScanLongest(regexMatcher *m, const unsigned char *t, int len) {
+  regexDFA *d = &m->rev;
+  nfaState *s = d->nfa->s;
+  int n = d->nfa->n, cn = 0;
+  int *state = m->threads, *end = state + n, *nstate = end + n, *nend = nstate + n;
+  if (len + 1 > m->longest_cap) {
+    m->longest_cap = len + 1;
+    m->longest = realloc(m->longest, sizeof(int) * m->longest_cap);
+  }
+  dfaNextGen(d);
+  dfaClosure(d, d->nfa->start, 1, 0, state, &cn);
+  for (int j = 0; j < cn; j++) end[j] = len;
+  for (int p = len - 1; p >= 0; p--) {
+    int nn = 0, from;
+    dfaNextGen(d);
+    for (int j = 0; j < cn; j++) {
+      nfaState *ns = &s[state[j]];
+      if (ns->op != NFA_SET || !(d->re->set[ns->set][t[p] >> 3] & (1 << (t[p] & 7)))) continue;
+      from = nn;
+      dfaClosure(d, ns->out, 0, 0, nstate, &nn);
+      while (from < nn) nend[from++] = end[j];
+    }
+    from = nn;
+    dfaClosure(d, d->nfa->start, 0, 0, nstate, &nn);
+    while (from < nn) nend[from++] = p;
+    int *swap = state; state = nstate; nstate = swap;
+    swap = end; end = nend; nend = swap;
+    cn = nn;
+    m->longest[p] = -1;
+    for (int j = 0; j < cn && m->longest[p] < 0; j++) {
+      int match = s[state[j]].op == NFA_MATCH;
+      if (!p && s[state[j]].op == NFA_EOL) {  // ^ in the pattern
+        int eols = 0;
+        dfaNextGen(d);
+        dfaClosure(d, s[state[j]].out, 0, 1, d->list, &eols);
+        while (eols--) if (s[d->list[eols]].op == NFA_MATCH) match = 1;
+      }
+      if (match) m->longest[p] = end[j];
+    }
+  }
+}
+// Append the matches in a line to v: the leftmost, then the leftmost after
+// it and so on, each as long as it can be; empty matches are skipped. The
+// unanchored reverse DFA reads the line backwards once, marking every
+// position a match starts at; the forward DFA then runs from the starts.
+// The forward runs can overlap (a|.*b on a line of a's runs to the end
+// from every a), so past a few passes over the line the rest of it is
+// left to regexScanLongest, which is linear.
+void regexScanText(regexMatcher *m, findVec *v, int row, const char *text, int len) {
+  regexDFA *rev = &m->rev, *fwd = &m->fwd;
+  const unsigned char *t = (const unsigned char *)text;
+  m->nstarts = 0;
+  dfaState *st = dfaStart(rev, 1);
+  for (int p = len - 1; p > 0; p--) {
+    st = st->next[t[p]] ? st->next[t[p]] : dfaStep(rev, st, t[p]);
+    if (st->accept) regexPushStart(m, p);
+  }
+  if (len) {
+    st = st->next[t[0]] ? st->next[t[0]] : dfaStep(rev, st, t[0]);
+    if (st->accept_eol) regexPushStart(m, 0);
+  }
+  int pos = 0, budget = 4 * len + 256;
+  for (int k = m->nstarts - 1; k >= 0; k--) {
+    int p = m->starts[k], end = -1;
+    if (p < pos) continue;
+    st = dfaStart(fwd, p == 0);
+    int i = p;
+    for (; i < len && st->nset; i++) {
+      st = st->next[t[i]] ? st->next[t[i]] : dfaStep(fwd, st, t[i]);
+      if (st->accept) end = i + 1;
+    }
+    if (st->accept_eol && st->nset && end < len) end = len;
+    if (end > p) { findPush(v, row, p, end - p); pos = end; }
+    if ((budget -= i - p) < 0) break;
+  }
+  if (budget >= 0) return;
+  if (!m->threads) m->threads = malloc(sizeof(int) * 4 * rev->nfa->n);
+  regexScanLongest(m, t, len);
+  for (int p = pos; p < len; p++)
+    if (m->longest[p] > p) { findPush(v, row, p, m->longest[p] - p); p = m->longest[p] - 1; }
+}
+// Text with tabs expanded as in render, or text itself if it has none.
+// The expansion goes to *scratch, grown as needed and reused by later calls.
+const char *findExpand(const char *text, int *len, char **scratch, int *cap) {
+  if (!memchr(text, '\t', *len)) return text;
+  int tabs = 0;
+  for (int j = 0; j < *len; j++) if (text[j] == '\t') tabs++;
+  if (*len + tabs * (TAB_STOP - 1) > *cap) {
+    *cap = *len + tabs * (TAB_STOP - 1);
+    *scratch = realloc(*scratch, *cap);
+  }
+  int idx = 0;
+  for (int j = 0; j < *len; j++) {
+    if (text[j] != '\t') { (*scratch)[idx++] = text[j]; continue; }
+    (*scratch)[idx++] = ' ';
+    while (idx % TAB_STOP != 0) (*scratch)[idx++] = ' ';
+  }
+  *len = idx;
+  return *scratch;
+}
+// Text of line off of node as search sees it: the raw text, or for render
+// searches the text with tabs expanded. The next call reuses the expansion.
+const char *editorFindText(rowNode *node, int off, int render, int *len) {
+  static char *scratch = NULL; static int scratch_cap = 0;
+  const char *text;
+  if (node->src >= 0) text = editorMappedLine(node->src + off, len);
+  else { text = node->row.chars; *len = node->row.size; }
+  return render ? findExpand(text, len, &scratch, &scratch_cap) : text;
+}
+void findPush(findVec *v, int row, int col, int len) {
+  if (v->n == v->cap) {
+    v->cap = v->cap ? v->cap * 2 : 1024;
+    v->m = realloc(v->m, sizeof(findMatch) * v->cap);
+  }
+  v->m[v->n++] = (findMatch){row, col, len};
+}
+void findScanText(findVec *v, int row, const char *text, int len, const char *q, int qlen) {
+  findKernel kernel = editorFindKernel();
+  const char *p = text, *end = text + len;
+  while (p < end && (p = kernel(p, end - p, q, qlen)) != NULL) {
+    findPush(v, row, p - text, qlen);
+    p++;
+  }
+}
+// Raw search over mapped lines [first, first + lines) in one pass over the
+// file, placing each match on its line by binary search in the line index.
+void findScanSpan(findVec *v, int first, int lines, int row, const char *q, int qlen) {
+  findKernel kernel = editorFindKernel();
+  size_t *off = E.line_off;
+  int last = first + lines;
+  size_t start = off[first], end = off[last] - 1;
+  if (end > E.map_avail) end = E.map_avail;
+  if (start > end) start = end;
+  const char *p = &E.map[start], *stop = &E.map[end];
+  int line = first;
+  while (p < stop && (p = kernel(p, stop - p, q, qlen)) != NULL) {
+    size_t pos = p - E.map;
+    int lo = line, hi = last - 1;
+    while (lo < hi) {
+      int mid = lo + (hi - lo + 1) / 2;
+      if (off[mid] <= pos) lo = mid; else hi = mid - 1;
+    }
+    line = lo;
+    findPush(v, row + line - first, pos - off[line], qlen);
+    p++;
+  }
+}
+void findPushLevel(findState *f, findLevel level) {
+  if (f->nlevels == f->level_cap) {
+    f->level_cap = f->level_cap ? f->level_cap * 2 : 16;
+    f->level = realloc(f->level, sizeof(findLevel) * f->level_cap);
+  }
+  f->level[f->nlevels++] = level;
+}
+// Append the matches of q in rows [from, to) to v, or of the regex rm
+// matches if rm isn't NULL. Stops early once *cancel is set, if given.
+void findScanRows(findVec *v, int from, int to, const char *q, int qlen, int render,
+                  regexMatcher *rm, char **scratch, int *cap, int *cancel) {
+  // A file cut short stops the scan; the buffer turns read-only with it.
+  sigjmp_buf jb, *outer = map_guard;
+  if (sigsetjmp(jb, 0)) { map_guard = outer; return; }
+  map_guard = &jb;
+  int off = 0, row = from;
+  rowNode *node = from < E.numrows ? rowTreeAt(from, &off) : NULL;
+  for (; node && row < to; node = node->next, off = 0) {
+    if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED)) break;
+    int n = node->lines - off < to - row ? node->lines - off : to - row;
+    if (node->src >= 0 && !render && !rm) findScanSpan(v, node->src + off, n, row, q, qlen);
+    else for (int j = 0; j < n; j++) {
+      int len; const char *text;
+      if (node->src >= 0) text = editorMappedLine(node->src + off + j, &len);
+      else { text = node->row.chars; len = node->row.size; }
+      if (render) text = findExpand(text, &len, scratch, cap);
+      if (rm) regexScanText(rm, v, row + j, text, len);
+      else findScanText(v, row + j, text, len, q, qlen);
+    }
+    row += n;
+  }
+  map_guard = outer;
+}
+// Push a level holding every match of q in the buffer.
+void findScanAll(findState *f, const char *q, int qlen, int render) {
+  static char *scratch = NULL; static int scratch_cap = 0;
+  findLevel level = { qlen, f->found.n, 0, render };
+  findScanRows(&f->found, 0, E.numrows, q, qlen, render, f->rm, &scratch, &scratch_cap, NULL);
+  level.count = f->found.n - level.start;
+  findPushLevel(f, level);
+}
+int find_wake[2] = {-1, -1};  // Workers write a byte here per batch
+void *findWorker(void *arg) {
+  findScan *s = arg;
+  char *scratch = NULL; int cap = 0;
+  regexMatcher *rm = s->re ? regexMatcherNew(s->re) : NULL;
+  while (!__atomic_load_n(&s->cancel, __ATOMIC_RELAXED)) {
+    int job = __atomic_fetch_add(&s->next_job, 1, __ATOMIC_RELAXED);
+    if (job >= s->njobs) break;
+    findBatch *b = calloc(1, sizeof(findBatch));
+    b->job = job;
+    int to = (job + 1) * FIND_JOB_ROWS;
+    pthread_rwlock_rdlock(&rows_lock);
+    findScanRows(&b->v, job * FIND_JOB_ROWS, to < E.numrows ? to : E.numrows,
+                 s->query, s->qlen, s->render, rm, &scratch, &cap, &s->cancel);
+    pthread_rwlock_unlock(&rows_lock);
+    b->next = __atomic_load_n(&s->done, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s->done, &b->next, b, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (write(find_wake[1], "", 1) == -1) { /* pipe full: a wakeup is pending */ }
+  }
+  free(scratch); regexMatcherFree(rm);
+  return NULL;
+}
+// Push an empty level for q and start workers filling it in the background.
+// Returns -1 if no worker could be started.
+int findScanStart(findState *f, const char *q, int qlen, int render) {
+  if (find_wake[0] == -1) {
+    if (pipe(find_wake) == -1) return -1;
+    fcntl(find_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(find_wake[1], F_SETFL, O_NONBLOCK);
+  }
+  findScan *s = calloc(1, sizeof(findScan));
+  s->query = malloc(qlen + 1); memcpy(s->query, q, qlen + 1);
+  s->qlen = qlen; s->render = render; s->re = f->re;
+  s->njobs = (E.numrows + FIND_JOB_ROWS - 1) / FIND_JOB_ROWS;
+  s->ready = calloc(s->njobs, sizeof(findBatch *));
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > FIND_MAX_THREADS) threads = FIND_MAX_THREADS;
+  if (threads > s->njobs) threads = s->njobs;
+  for (; s->nthreads < threads; s->nthreads++)
+    if (pthread_create(&s->tid[s->nthreads], NULL, findWorker, s) != 0) break;
+  if (s->nthreads == 0) { free(s->ready); free(s->query); free(s); return -1; }
+  findLevel level = { qlen, f->found.n, 0, render };
+  findPushLevel(f, level);
+  f->scan = s;
+  return 0;
+}
+void findScanFree(findScan *s) {
+  for (int t = 0; t < s->nthreads; t++) pthread_join(s->tid[t], NULL);
+  findBatch *b = __atomic_exchange_n(&s->done, NULL, __ATOMIC_ACQUIRE);
+  while (b) { findBatch *next = b->next; free(b->v.m); free(b); b = next; }
+  for (int j = s->appended; j < s->njobs; j++)
+    if (s->ready[j]) { free(s->ready[j]->v.m); free(s->ready[j]); }
+  free(s->ready); free(s->query); free(s);
+}
+// Stop the running scan and drop the level it was filling.
+void findScanCancel(findState *f) {
+  __atomic_store_n(&f->scan->cancel, 1, __ATOMIC_RELAXED);
+  findScanFree(f->scan);
+  f->scan = NULL;
+  f->found.n = 0; f->nlevels = 0;
+}
+// Move finished batches into the level, in row order. Returns whether the
+// level grew; the scan is freed once every job is in.
+int findScanCollect(findState *f) {
+  findScan *s = f->scan;
+  char drain[64];
+  while (read(find_wake[0], drain, sizeof(drain)) > 0);
+  findBatch *b = __atomic_exchange_n(&s->done, NULL, __ATOMIC_ACQUIRE);
+  while (b) { findBatch *next = b->next; s->ready[b->job] = b; b = next; }
+  findLevel *level = &f->level[0];
+  int grew = 0;
+  for (; s->appended < s->njobs && s->ready[s->appended]; s->appended++) {
+    findVec *v = &s->ready[s->appended]->v, *found = &f->found;
+    if (found->n + v->n > found->cap) {
+      while (found->n + v->n > found->cap) found->cap = found->cap ? found->cap * 2 : 1024;
+      found->m = realloc(found->m, sizeof(findMatch) * found->cap);
+    }
+    if (v->n) memcpy(found->m + found->n, v->m, sizeof(findMatch) * v->n);
+    found->n += v->n; level->count += v->n; grew |= v->n > 0;
+    free(v->m); free(s->ready[s->appended]);
+  }
+  if (s->appended == s->njobs) { findScanFree(s); f->scan = NULL; }
+  return grew;
+}
+// Push a level holding the matches of the top level that q still matches.
+// A raw level narrows into a render one too: a prefix without spaces spans
+// no tabs, so each render match of q starts at a raw match of the prefix.
+void findNarrow(findState *f, const char *q, int qlen, int render) {
+  findLevel top = f->level[f->nlevels - 1];
+  findLevel level = { qlen, f->found.n, 0, render };
+  if (top.count > E.numrows / FIND_NARROW_DENSE) {  // Scanning the rows is quicker
+    findScanAll(f, q, qlen, render);
+    return;
+  }
+  // Matches are in row order: step along the row list to the next matched
+  // row when it is near, and look it up in the tree when it isn't.
+  sigjmp_buf jb, *outer = map_guard;
+  if (sigsetjmp(jb, 0)) { map_guard = outer; top.count = 0; }
+  else map_guard = &jb;
+  rowNode *node = NULL;
+  int row = -1, off = 0, len = 0, convert = 0; const char *raw = NULL, *text = NULL;
+  for (int j = top.start; j < top.start + top.count; j++) {
+    findMatch m = f->found.m[j];
+    if (m.row != row) {
+      if (node && m.row - row < FIND_NARROW_WALK) {
+        for (off += m.row - row; off >= node->lines; node = node->next) off -= node->lines;
+      } else node = rowTreeAt(m.row, &off);
+      row = m.row;
+      int rawlen;
+      raw = editorFindText(node, off, 0, &rawlen);
+      text = raw; len = rawlen;
+      if (render && memchr(raw, '\t', rawlen)) text = editorFindText(node, off, 1, &len);
+      convert = text != raw && !top.render;
+    }
+    int col = m.col;
+    if (convert) {
+      col = 0;
+      for (int k = 0; k < m.col; k++) col += raw[k] == '\t' ? TAB_STOP - col % TAB_STOP : 1;
+    }
+    if (col + qlen <= len && !memcmp(text + col, q, qlen)) findPush(&f->found, m.row, col, qlen);
+  }
+  map_guard = outer;
+  level.count = f->found.n - level.start;
+  findPushLevel(f, level);
+}
+// Drop all results, stopping the scan if one is running, and the pattern.
+void findClear(findState *f) {
+  if (f->scan) findScanCancel(f);
+  f->found.n = f->nlevels = 0;
+  regexMatcherFree(f->rm); regexFree(f->re);
+  f->rm = NULL; f->re = NULL; f->error = NULL;
+}
+// Regex searches rescan for every new pattern, matching the raw text.
+void findUpdateRegex(findState *f, const char *q, int qlen) {
+  if (f->nlevels && f->level[0].qlen == qlen && !memcmp(f->query, q, qlen)) return;
+  findClear(f);
+  if (qlen + 1 > f->query_cap) {
+    f->query_cap = qlen + 1;
+    f->query = realloc(f->query, f->query_cap);
+  }
+  memcpy(f->query, q, qlen + 1);
+  if (!(f->re = regexCompile(q, &f->error))) return;
+  f->rm = regexMatcherNew(f->re);
+  if (E.numrows < FIND_ASYNC_ROWS || findScanStart(f, q, qlen, 0) == -1)
+    findScanAll(f, q, qlen, 0);
+}
+// Make the top level hold the matches of q, reusing or narrowing the levels
+// of earlier queries where q extends them. A change to the query while a
+// scan runs cancels it: its level can't be narrowed until it is complete.
+void findUpdate(findState *f, const char *q, int qlen) {
+  int render = memchr(q, ' ', qlen) != NULL;
+  if (f->regex) { findUpdateRegex(f, q, qlen); return; }
+  if (f->scan && (f->scan->qlen != qlen || memcmp(f->scan->query, q, qlen)))
+    findScanCancel(f);
+  while (f->nlevels) {
+    findLevel *top = &f->level[f->nlevels - 1];
+    if (top->qlen <= qlen && !memcmp(f->query, q, top->qlen)) break;
+    f->found.n = top->start; f->nlevels--;
+  }
+  if (f->nlevels && f->level[f->nlevels - 1].qlen == qlen) return;
+  if (qlen + 1 > f->query_cap) {
+    f->query_cap = qlen + 1;
+    f->query = realloc(f->query, f->query_cap);
+  }
+  memcpy(f->query, q, qlen + 1);
+  if (f->nlevels) findNarrow(f, q, qlen, render);
+  else if (E.numrows < FIND_ASYNC_ROWS || findScanStart(f, q, qlen, render) == -1)
+    findScanAll(f, q, qlen, render);
+}
+void findReset(findState *f) {
+  findClear(f);
+  free(f->found.m); free(f->level); free(f->query);
+  memset(f, 0, sizeof(*f));
+}
+// Move the cursor to the current match.
+void findShow(findState *f) {
+  findLevel *top = &f->level[f->nlevels - 1];
+  findMatch m = f->found.m[top->start + f->current];
+  E.cy = m.row;
+  E.cx = top->render ? editorRowRxToCx(editorRow(m.row), m.col) : m.col;
+  E.rowoff = E.numrows;
+}
+// Render-column spans of the matches on a row, in order, for drawing.
+int editorFindSpans(erow *row, int filerow, findSpan **spans) {
+  static findSpan *buf = NULL; static int cap = 0;
+  findState *f = &E.find;
+  if (!f->nlevels) return 0;
+  findLevel *top = &f->level[f->nlevels - 1];
+  findMatch *m = &f->found.m[top->start];
+  int lo = 0, hi = top->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (m[mid].row < filerow) lo = mid + 1; else hi = mid;
+  }
+  int n = 0, cx = 0, rx = 0;
+  for (int j = lo; j < top->count && m[j].row == filerow; j++, n++) {
+    if (n == cap) { cap = cap ? cap * 2 : 16; buf = realloc(buf, sizeof(findSpan) * cap); }
+    if (top->render) { buf[n] = (findSpan){m[j].col, m[j].col + m[j].len}; continue; }
+    for (int k = 0; k < 2; k++) {
+      int to = k ? m[j].col + m[j].len : m[j].col;
+      for (; cx < to && cx < row->size; cx++)
+        rx += row->chars[cx] == '\t' ? TAB_STOP - rx % TAB_STOP : 1;
+      if (k) buf[n].to = rx; else buf[n].from = rx;
+    }
+  }
+  *spans = buf;
+  return n;
+}
+// Called by the event loop when a running scan has finished batches: take
+// them in, and show the first match as soon as there is one.
+void editorFindIdle() {
+  findState *f = &E.find;
+  int had = f->level[0].count;
+  if (findScanCollect(f) && had == 0 && f->nlevels == 1) findShow(f);
+  E.frame_pending = 1;
+}
+void editorFindCallback(char *query, int key) {
+  findState *f = &E.find;
+  if (key == '\r' || key == '\x1b') { findReset(f); return; }
+  int qlen = strlen(query);
+  if (qlen == 0) { findClear(f); return; }
+  int before = f->nlevels ? f->level[f->nlevels - 1].qlen : -1;
+  findUpdate(f, query, qlen);
+  if (!f->nlevels) return;
+  findLevel *top = &f->level[f->nlevels - 1];
+  if (before != qlen) f->current = 0;
+  if (top->count == 0) return;
+  // While a scan is still running there is no last match to wrap around to.
+  int next = before == qlen && (key == ARROW_RIGHT || key == ARROW_DOWN);
+  int prev = before == qlen && (key == ARROW_LEFT || key == ARROW_UP);
+  if (next && f->current + 1 < top->count) f->current++;
+  else if (next && !f->scan) f->current = 0;
+  else if (prev && f->current > 0) f->current--;
+  else if (prev && !f->scan) f->current = top->count - 1;
+  findShow(f);
+}
+void editorFind(int regex) {
   int saved_cx = E.cx, saved_cy = E.cy;
   int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  findReset(&E.find);
+  E.find.regex = regex;
+  char *query = editorPrompt(regex ? "Regex: %s (Use ESC/Arrows/Enter)"
+                                   : "Search: %s (Use ESC/Arrows/Enter)", editorFindCallback, 0);
   if (query) { free(query);
   } else {
     E.cx = saved_cx; E.cy = saved_cy;
     E.coloff = saved_coloff; E.rowoff = saved_rowoff;
   }
 }
-struct abuf { char *b; int len; };
-#define ABUF_INIT {NULL, 0}
+// Replace every match of q with `with` in one pass over the buffer, as a
+// single undo step that keeps only the match positions. Returns how many
+// matches were replaced.
+int editorReplaceAll(const char *q, const char *with) {
+  int qlen = strlen(q), wlen = strlen(with);
+  findVec v = { NULL, 0, 0 };
+  char *scratch = NULL; int cap = 0;
+  findScanRows(&v, 0, E.numrows, q, qlen, 0, NULL, &scratch, &cap, NULL);
+  free(scratch);
+  // The scan reports overlapping matches; replace the leftmost of each run.
+  int n = 0;
+  for (int j = 0; j < v.n; j++)
+    if (!n || v.m[j].row != v.m[n - 1].row || v.m[j].col >= v.m[n - 1].col + qlen)
+      v.m[n++] = v.m[j];
+  if (n == 0) { free(v.m); return 0; }
+  editorReplaceMatches(v.m, n, with, wlen);
+  if (!E.in_undo) {
+    undoRecord *r = undoAlloc(UNDO_REPLACE_ALL, E.cy, E.cx, qlen, wlen, n);
+    memcpy(undoMatches(r), v.m, sizeof(findMatch) * n);
+    memcpy(undoText(r), q, qlen);
+    memcpy(undoText(r) + qlen, with, wlen);
+  }
+  free(v.m);
+  if (E.cy < E.numrows && E.cx > editorRow(E.cy)->size) E.cx = editorRow(E.cy)->size;
+  return n;
+}
+// The query prompt previews the matches as Ctrl-F does.
+void editorReplace() {
+  if (editorCutShort()) return;
+  int saved_cx = E.cx, saved_cy = E.cy;
+  int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
+  findReset(&E.find);
+  char *query = editorPrompt("Replace: %s (Use ESC/Arrows/Enter)", editorFindCallback, 0);
+  char *with = query ? editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1) : NULL;
+  E.cx = saved_cx; E.cy = saved_cy;
+  E.coloff = saved_coloff; E.rowoff = saved_rowoff;
+  if (with) {
+    editorClearSelection();
+    int n = editorReplaceAll(query, with);
+    if (n) editorSetStatusMessage("Replaced %d occurrence%s", n, n == 1 ? "" : "s");
+    else editorSetStatusMessage("No matches for \"%s\"", query);
+  }
+  free(query); free(with);
+}
+// Append buffer: a chain of chunks, each twice the size of the one before.
+// Filled chunks are never copied together; abWrite hands them to writev.
+// Kept across frames and emptied with abReset, a buffer stops allocating
+// once its chain has grown to the largest frame it has held.
+#define AB_CHUNK_MIN 4096
+#define AB_MAX_CHUNKS 24
+struct abuf {
+  char *chunk[AB_MAX_CHUNKS]; int used[AB_MAX_CHUNKS];
+  int nchunks, cur, len;
+};
+#define ABUF_INIT {{NULL}, {0}, 0, 0, 0}
+int abChunkSize(int j) { return AB_CHUNK_MIN << j; }
 void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new; ab->len += len;
+  while (len > 0) {
+    if (ab->cur < ab->nchunks && ab->used[ab->cur] == abChunkSize(ab->cur)) ab->cur++;
+    if (ab->cur == ab->nchunks) {
+      if (ab->nchunks == AB_MAX_CHUNKS) return;
+      char *chunk = malloc(abChunkSize(ab->nchunks));
+      if (chunk == NULL) return;
+      ab->chunk[ab->nchunks] = chunk; ab->used[ab->nchunks++] = 0;
+    }
+    int room = abChunkSize(ab->cur) - ab->used[ab->cur];
+    int n = len < room ? len : room;
+    memcpy(&ab->chunk[ab->cur][ab->used[ab->cur]], s, n);
+    ab->used[ab->cur] += n; ab->len += n;
+    s += n; len -= n;
+  }
+}
+void abReset(struct abuf *ab) {
+  for (int j = 0; j <= ab->cur && j < ab->nchunks; j++) ab->used[j] = 0;
+  ab->cur = 0; ab->len = 0;
+}
+// Write the whole buffer to fd, resuming after short writes.
+int abWrite(struct abuf *ab, int fd) {
+  struct iovec iov[AB_MAX_CHUNKS];
+  int n = 0;
+  for (int j = 0; j < ab->nchunks && ab->used[j]; j++) {
+    iov[n].iov_base = ab->chunk[j]; iov[n++].iov_len = ab->used[j];
+  }
+  struct iovec *v = iov;
+  while (n > 0) {
+    ssize_t w = writev(fd, v, n);
+    if (w == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= v->iov_len) { w -= v->iov_len; v++; n--; }
+    if (n > 0) { v->iov_base = (char *)v->iov_base + w; v->iov_len -= w; }
+  }
+  return 0;
+}
+void abFree(struct abuf *ab) {
+  for (int j = 0; j < ab->nchunks; j++) free(ab->chunk[j]);
+}
+// Screen grid. The draw functions paint the back grid through a pen that
+// behaves like the terminal did when they wrote to it directly: colour
+// sequences set the pen's foreground or background, text fills cells left
+// to right and \x1b[K blanks the rest of the row. screenFlush then writes
+// only the cells that differ from the front grid.
+int screenGlyphLen(unsigned char c) {
+  if (c >= 0xF0 && c < 0xF8) return 4;
+  if (c >= 0xE0) return c < 0xF0 ? 3 : 1;
+  if (c >= 0xC0) return 2;
+  return 1;
+}
+// Index of an SGR sequence, interning it on first sight. Only the pointer
+// is kept: the sequences are the COLOR_ literals and the status colours.
+int screenStyle(const char *seq) {
+  for (int j = 1; j < E.nsgr; j++) if (!strcmp(E.sgr[j], seq)) return j;
+  if (E.nsgr == 0) E.nsgr = 1;
+  if (E.nsgr == SCREEN_STYLES) return 0;  // Out of slots: draw in the default
+  E.sgr[E.nsgr] = seq;
+  return E.nsgr++;
+}
+void screenBegin(int rows, int cols) {
+  if (rows != E.grid_rows || cols != E.grid_cols) {
+    free(E.front); free(E.back);
+    E.front = calloc(rows * cols, sizeof(screenCell));
+    E.back = malloc(rows * cols * sizeof(screenCell));
+    E.grid_rows = rows; E.grid_cols = cols;
+    E.term_y = E.term_fg = E.term_bg = -1;
+  }
+  screenCell blank = { " ", 1, 0, 0 };
+  for (int j = 0; j < rows * cols; j++) E.back[j] = blank;
+  E.pen_y = E.pen_x = E.pen_fg = E.pen_bg = 0;
+}
+void screenMove(int y, int x) { E.pen_y = y; E.pen_x = x; }
+void screenSgr(const char *seq) {
+  if (!strcmp(seq, COLOR_RESET)) E.pen_fg = E.pen_bg = 0;
+  else if (!strncmp(seq, "\x1b[38;", 5)) E.pen_fg = screenStyle(seq);
+  else if (!strncmp(seq, "\x1b[48;", 5)) E.pen_bg = screenStyle(seq);
+}
+void screenPut(const char *s, int len) {
+  for (int i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (E.pen_y < 0 || E.pen_y >= E.grid_rows) continue;
+    if ((c & 0xC0) == 0x80 && E.pen_x > 0 && E.pen_x <= E.grid_cols) {
+      screenCell *prev = &E.back[E.pen_y * E.grid_cols + E.pen_x - 1];
+      if (prev->len < screenGlyphLen(prev->ch[0])) { prev->ch[prev->len++] = c; continue; }
+    }
+    if (E.pen_x >= E.grid_cols) continue;
+    screenCell cell = { { c }, 1, c == ' ' ? 0 : E.pen_fg, E.pen_bg };
+    E.back[E.pen_y * E.grid_cols + E.pen_x++] = cell;
+  }
+}
+void screenClearEol() {
+  if (E.pen_y < 0 || E.pen_y >= E.grid_rows) return;
+  screenCell blank = { " ", 1, 0, E.pen_bg };
+  for (int x = E.pen_x; x < E.grid_cols; x++) E.back[E.pen_y * E.grid_cols + x] = blank;
+}
+int screenCellEq(screenCell *a, screenCell *b) {
+  return !memcmp(a, b, sizeof(screenCell));
+}
+// Switch the terminal to the colours of cell; blanks only need the background.
+void screenPen(struct abuf *ab, screenCell *cell) {
+  int blank = cell->len == 1 && cell->ch[0] == ' ';
+  int fg = blank ? E.term_fg : cell->fg;
+  if (fg == E.term_fg && cell->bg == E.term_bg) return;
+  if (fg == 0 && cell->bg == 0) {
+    abAppend(ab, COLOR_RESET, strlen(COLOR_RESET));
+  } else {
+    if (fg != E.term_fg) {
+      const char *seq = fg ? E.sgr[fg] : "\x1b[39m";
+      abAppend(ab, seq, strlen(seq));
+    }
+    if (cell->bg != E.term_bg) {
+      const char *seq = cell->bg ? E.sgr[cell->bg] : "\x1b[49m";
+      abAppend(ab, seq, strlen(seq));
+    }
+  }
+  E.term_fg = fg; E.term_bg = cell->bg;
+}
+void screenEmit(struct abuf *ab, screenCell *cell) {
+  screenPen(ab, cell);
+  abAppend(ab, cell->ch, cell->len);
+  // Past the last column the cursor sits in the pending-wrap state.
+  if (++E.term_x == E.grid_cols) E.term_y = -1;
+}
+// Move the terminal cursor to (y, x) with the shortest sequence on hand:
+// nothing, rewriting a few cells already in the pen's colours, CR, CR LF,
+// a relative move right or an absolute position.
+void screenCursorTo(struct abuf *ab, int y, int x) {
+  if (E.term_y == y && E.term_x == x) return;
+  char buf[32]; int len;
+  if (E.term_y == y && x > E.term_x && x - E.term_x <= 4) {
+    screenCell *row = &E.back[y * E.grid_cols];
+    int j;
+    for (j = E.term_x; j < x; j++) {
+      screenCell *cell = &row[j];
+      int blank = cell->len == 1 && cell->ch[0] == ' ';
+      if (cell->bg != E.term_bg || (!blank && cell->fg != E.term_fg)) break;
+    }
+    if (j == x) { while (E.term_x < x) screenEmit(ab, &row[E.term_x]); return; }
+  }
+  if (E.term_y == y && x == 0) len = snprintf(buf, sizeof(buf), "\r");
+  else if (E.term_y >= 0 && E.term_y + 1 == y && x == 0) len = snprintf(buf, sizeof(buf), "\r\n");
+  else if (E.term_y == y && x > E.term_x) len = snprintf(buf, sizeof(buf), "\x1b[%dC", x - E.term_x);
+  else if (x == 0) len = snprintf(buf, sizeof(buf), "\x1b[%dH", y + 1);
+  else len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+  E.term_y = y; E.term_x = x;
+}
+// Append what turns the terminal's frame into the back grid, leaving the
+// cursor at (cy, cx), and make the back grid the new front.
+void screenFlush(struct abuf *ab, int cy, int cx) {
+  int rows = E.grid_rows, cols = E.grid_cols, hidden = 0;
+  for (int y = 0; y < rows; y++) {
+    screenCell *front = &E.front[y * cols], *back = &E.back[y * cols];
+    if (!memcmp(front, back, cols * sizeof(screenCell))) continue;
+    // Default blanks from here to the end of the row go out as one \x1b[K.
+    int tail = cols;
+    while (tail > 0 && back[tail - 1].len == 1 && back[tail - 1].ch[0] == ' ' &&
+           back[tail - 1].bg == 0) tail--;
+    for (int x = 0; x < cols; x++) {
+      if (screenCellEq(&front[x], &back[x])) continue;
+      if (!hidden) { abAppend(ab, "\x1b[?25l", 6); hidden = 1; }
+      screenCursorTo(ab, y, x);
+      if (x >= tail && cols - x > 3) {
+        screenPen(ab, &back[x]);
+        abAppend(ab, "\x1b[K", 3);
+        break;
+      }
+      screenEmit(ab, &back[x]);
+    }
+  }
+  memcpy(E.front, E.back, rows * cols * sizeof(screenCell));
+  screenCursorTo(ab, cy, cx);
+  if (hidden) abAppend(ab, "\x1b[?25h", 6);
 }
-void abFree(struct abuf *ab) { free(ab->b); }
 void editorScroll() {
   E.rx = 0;
-  if (E.cy < E.numrows) E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+  if (E.cy < E.numrows) E.rx = editorRowCxToRx(editorRow(E.cy), E.cx);
   if (E.cy < E.rowoff) E.rowoff = E.cy;
   if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
   if (E.rx < E.coloff) E.coloff = E.rx;
   if (E.rx >= E.coloff + E.editor_width) E.coloff = E.rx - E.editor_width + 1;
 }
-void editorDrawRows(struct abuf *ab) {
+// The render columns [*from, *to) of a row that the selection covers.
+void editorSelectionSpan(erow *row, int filerow, int *from, int *to) {
+  *from = *to = 0;
+  if (!E.selection_active || filerow < E.sel_start_cy || filerow > E.sel_end_cy) return;
+  *to = row->rsize;
+  if (filerow == E.sel_start_cy)
+    *from = editorRowCxToRx(row, E.sel_start_cx < row->size ? E.sel_start_cx : row->size);
+  if (filerow == E.sel_end_cy)
+    *to = editorRowCxToRx(row, E.sel_end_cx < row->size ? E.sel_end_cx : row->size);
+}
+void editorDrawRows() {
   editorNormalizeSelection(); 
   for (int y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
@@ -1022,154 +3983,365 @@ void editorDrawRows(struct abuf *ab) {
             int welcomelen = strlen(line);
             int padding = (E.editor_width - welcomelen) / 2;
             if (padding > 0) {
-                for (int i=0; i < padding; i++) abAppend(ab, " ", 1);
+                for (int i=0; i < padding; i++) screenPut(" ", 1);
             }
-            abAppend(ab, line, welcomelen);
+            screenPut(line, welcomelen);
         }
       }
     } else {
       char buf[16];
-      if (filerow == E.cy) abAppend(ab, COLOR_LINENO_CURRENT, strlen(COLOR_LINENO_CURRENT));
-      else abAppend(ab, COLOR_LINENO, strlen(COLOR_LINENO));
+      if (filerow == E.cy) screenSgr(COLOR_LINENO_CURRENT);
+      else screenSgr(COLOR_LINENO);
       snprintf(buf, sizeof(buf), "%4d ", filerow + 1);
-      abAppend(ab, buf, strlen(buf));
-      abAppend(ab, COLOR_BG, strlen(COLOR_BG));
-      erow *row = &E.row[filerow];
+      screenPut(buf, strlen(buf));
+      screenSgr(COLOR_BG);
+      erow *row = editorRenderRow(filerow);
       int len = row->rsize - E.coloff;
       if (len < 0) len = 0;
       if (len > E.editor_width - 5) len = E.editor_width - 5;
       char *c = &row->render[E.coloff]; unsigned char *hl = &row->hl[E.coloff];
       const char* current_color = COLOR_FG;
-      abAppend(ab, current_color, strlen(current_color));
-      int in_selection = 0;
+      screenSgr(current_color);
+      int in_selection = 0, sel_from, sel_to;
+      editorSelectionSpan(row, filerow, &sel_from, &sel_to);
+      sel_from -= E.coloff; sel_to -= E.coloff;
+      findSpan *match; int nmatch = editorFindSpans(row, filerow, &match), k = 0;
       for (int j = 0; j < len; j++) {
-        int is_selected = 0;
-        if (E.selection_active) {
-            int current_cx = editorRowRxToCx(row, E.coloff + j);
-            if (filerow > E.sel_start_cy && filerow < E.sel_end_cy) is_selected = 1;
-            else if (filerow == E.sel_start_cy && filerow == E.sel_end_cy) {
-                if (current_cx >= E.sel_start_cx && current_cx < E.sel_end_cx) is_selected = 1;
-            } else if (filerow == E.sel_start_cy) {
-                if (current_cx >= E.sel_start_cx) is_selected = 1;
-            } else if (filerow == E.sel_end_cy) {
-                if (current_cx < E.sel_end_cx) is_selected = 1;
-            }
-        }
-        const char *color = editorSyntaxToAnsiColor(hl[j]);
+        int is_selected = j >= sel_from && j < sel_to;
+        int h = hl[j];
+        while (k < nmatch && match[k].to <= E.coloff + j) k++;
+        if (k < nmatch && match[k].from <= E.coloff + j) h = HL_MATCH;
+        const char *color = editorSyntaxToAnsiColor(h);
         if (is_selected && !in_selection) {
-            abAppend(ab, COLOR_SELECTION_BG, strlen(COLOR_SELECTION_BG));
-            abAppend(ab, color, strlen(color));
+            screenSgr(COLOR_SELECTION_BG);
+            screenSgr(color);
             in_selection = 1;
         } else if (!is_selected && in_selection) {
-            abAppend(ab, COLOR_RESET, strlen(COLOR_RESET));
-            abAppend(ab, COLOR_BG, strlen(COLOR_BG));
-            abAppend(ab, color, strlen(color)); 
+            screenSgr(COLOR_RESET);
+            screenSgr(COLOR_BG);
+            screenSgr(color); 
             in_selection = 0;
         }
         if (strcmp(color, current_color)) {
+            // COLOR_MATCH is a background; the colours after it are not.
+            if (!strcmp(current_color, COLOR_MATCH) && !in_selection) screenSgr(COLOR_BG);
             current_color = color;
-            if (!in_selection) abAppend(ab, color, strlen(color));
+            if (!in_selection) screenSgr(color);
+        }
+        screenPut(&c[j], 1);
+      }
+      screenSgr(COLOR_RESET);
+    }
+    screenClearEol(); screenMove(E.pen_y + 1, 0);
+  }
+}
+int dir_wake[2] = {-1, -1};  // The loader writes a byte here when done
+int dirCompare(const dirEntry *a, const dirEntry *b) {
+  if (a->is_dir != b->is_dir) return b->is_dir - a->is_dir;
+  return strcmp(a->name, b->name);
+}
+int dirCompareQsort(const void *a, const void *b) { return dirCompare(a, b); }
+// Whether a ".." row leads up: a directory is shown and isn't the root.
+int dirHasParent() { return E.dir.path && strcmp(E.dir.path, "/") != 0; }
+void *dirLoadThread(void *arg) {
+  dirLoad *l = arg;
+  DIR *d = opendir(l->path);
+  if (!d) l->error = errno;
+  int cap = 0;
+  struct dirent *de;
+  while (d && (de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.') continue;
+    struct stat st;
+    int is_dir = de->d_type == DT_DIR;
+    if ((de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) &&
+        fstatat(dirfd(d), de->d_name, &st, 0) == 0)
+      is_dir = S_ISDIR(st.st_mode);
+    if (l->n == cap) { cap = cap ? cap * 2 : 256; l->e = realloc(l->e, sizeof(dirEntry) * cap); }
+    l->e[l->n++] = (dirEntry){ strdup(de->d_name), is_dir };
+  }
+  if (d) closedir(d);
+  if (l->n) qsort(l->e, l->n, sizeof(dirEntry), dirCompareQsort);
+  if (write(dir_wake[1], "", 1) == -1) { /* pipe full */ }
+  return NULL;
+}
+// Show the directory at path: watch it, then read it on a loader thread.
+// Watching first means nothing that happens meanwhile is missed, as its
+// events are only taken once the load has landed.
+void editorDirOpen(const char *path) {
+  dirModel *m = &E.dir;
+  if (m->load) return;
+  char *abs = realpath(path, NULL);
+  if (!abs) { editorSetStatusMessage("Can't open %s: %s", path, strerror(errno)); return; }
+  if (dir_wake[0] == -1) {
+    if (pipe(dir_wake) == -1) { free(abs); return; }
+    fcntl(dir_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(dir_wake[1], F_SETFL, O_NONBLOCK);
+  }
+  if (m->ifd == -1) m->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (m->wd != -1) inotify_rm_watch(m->ifd, m->wd);
+  m->wd = m->ifd == -1 ? -1 : inotify_add_watch(m->ifd, abs, IN_CREATE | IN_DELETE |
+      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+  // Coming back up, keep the directory we left selected.
+  char *from = NULL;
+  if (m->path && strlen(abs) < strlen(m->path) && !strncmp(abs, m->path, strlen(abs)))
+    from = strrchr(m->path, '/');
+  dirLoad *l = calloc(1, sizeof(dirLoad));
+  l->path = strdup(abs);
+  if (from) l->select = strdup(from + 1);
+  free(m->path); m->path = abs;
+  m->selected = m->scroll = 0;
+  m->load = l;
+  if (pthread_create(&l->tid, NULL, dirLoadThread, l) != 0) {
+    free(l->select); free(l->path); free(l);
+    m->load = NULL;
+    editorSetStatusMessage("Can't read %s: %s", path, strerror(errno));
+  }
+}
+// A load landed: swap its entries in.
+void editorDirIdle() {
+  dirModel *m = &E.dir;
+  char drain[64];
+  while (read(dir_wake[0], drain, sizeof(drain)) > 0);
+  dirLoad *l = m->load;
+  if (!l) return;
+  pthread_join(l->tid, NULL);
+  m->load = NULL;
+  for (int i = 0; i < m->n; i++) free(m->e[i].name);
+  free(m->e);
+  m->e = l->e; m->n = m->cap = l->n;
+  if (l->error) editorSetStatusMessage("Can't read %s: %s", l->path, strerror(l->error));
+  int up = dirHasParent();
+  for (int i = 0; l->select && i < m->n; i++)
+    if (m->e[i].is_dir && !strcmp(m->e[i].name, l->select)) m->selected = i + up;
+  free(l->select); free(l->path); free(l);
+  E.frame_pending = 1;
+}
+int dirFind(dirEntry *key) {
+  int lo = 0, hi = E.dir.n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (dirCompare(&E.dir.e[mid], key) < 0) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+void dirInsert(const char *name, int is_dir) {
+  dirModel *m = &E.dir;
+  dirEntry key = { (char *)name, is_dir };
+  int at = dirFind(&key);
+  if (at < m->n && !dirCompare(&m->e[at], &key)) return;
+  if (m->n == m->cap) { m->cap = m->cap ? m->cap * 2 : 256; m->e = realloc(m->e, sizeof(dirEntry) * m->cap); }
+  memmove(&m->e[at + 1], &m->e[at], sizeof(dirEntry) * (m->n - at));
+  m->e[at] = (dirEntry){ strdup(name), is_dir };
+  m->n++;
+  int up = dirHasParent();
+  if (m->selected >= at + up) m->selected++;
+}
+void dirRemove(const char *name) {
+  dirModel *m = &E.dir;
+  for (int is_dir = 0; is_dir < 2; is_dir++) {
+    dirEntry key = { (char *)name, is_dir };
+    int at = dirFind(&key);
+    if (at == m->n || dirCompare(&m->e[at], &key)) continue;
+    free(m->e[at].name);
+    memmove(&m->e[at], &m->e[at + 1], sizeof(dirEntry) * (m->n - at - 1));
+    m->n--;
+    int up = dirHasParent();
+    if (m->selected > at + up || m->selected == m->n + up) m->selected--;
+    if (m->selected < 0) m->selected = 0;
+    return;
+  }
+}
+// Apply the directory's inotify events to the model. A lost event or the
+// directory itself going away means reading it again.
+void editorDirEvents() {
+  dirModel *m = &E.dir;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  int reload = 0;
+  while ((n = read(m->ifd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->mask & IN_Q_OVERFLOW) { reload = 1; continue; }
+      if (ev->wd != m->wd) continue;
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) { reload = 1; continue; }
+      if (!ev->len || ev->name[0] == '.') continue;
+      if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) dirRemove(ev->name);
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        int is_dir = (ev->mask & IN_ISDIR) != 0;
+        if (!is_dir) {
+          // A symlink to a directory is listed as one.
+          char path[strlen(m->path) + strlen(ev->name) + 2];
+          sprintf(path, "%s/%s", m->path, ev->name);
+          struct stat st;
+          is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
         }
-        abAppend(ab, &c[j], 1);
+        dirRemove(ev->name);  // A rename over an existing entry
+        dirInsert(ev->name, is_dir);
       }
-      abAppend(ab, COLOR_RESET, strlen(COLOR_RESET));
     }
-    abAppend(ab, "\x1b[K", 3); abAppend(ab, "\r\n", 2);
   }
+  if (reload) {
+    // Fall back to the nearest directory that still exists.
+    char *path = strdup(m->path);
+    struct stat st;
+    while (stat(path, &st) == -1 && strcmp(path, "/")) {
+      char *slash = strrchr(path, '/');
+      if (slash == path) slash[1] = '\0'; else *slash = '\0';
+    }
+    editorDirOpen(path);
+    free(path);
+  }
+  E.frame_pending = 1;
+}
+// Put up to width bytes of s, not splitting a UTF-8 sequence.
+int sidebarPut(const char *s, int len, int width) {
+    if (len > width) {
+        len = width;
+        while (len > 0 && (s[len] & 0xc0) == 0x80) len--;
+    }
+    screenPut(s, len);
+    return len;
 }
-void editorDrawSidebar(struct abuf *ab) {
+// Draw the explorer from its model; no syscalls here.
+void editorDrawSidebar() {
     if (!E.sidebar_visible) return;
-    char buf[32];
+    dirModel *m = &E.dir;
+    int width = E.screencols - E.editor_width - 2;
     for (int y = 0; y < E.screenrows; y++) {
-        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 2, E.editor_width + 1);
-        abAppend(ab, buf, strlen(buf));
-        abAppend(ab, COLOR_SIDEBAR_BORDER, strlen(COLOR_SIDEBAR_BORDER));
-        abAppend(ab, "│", 3);
-    }
-    DIR *d = opendir(".");
-    if (d) {
-        struct dirent *dir; int y = 0;
-        snprintf(buf, sizeof(buf), "\x1b[2;%dH", E.editor_width + 3);
-        abAppend(ab, buf, strlen(buf));
-        abAppend(ab, COLOR_FG, strlen(COLOR_FG));
-        abAppend(ab, "EXPLORER", 8);
-        while ((dir = readdir(d)) != NULL && y < E.screenrows - 2) {
-            if (dir->d_name[0] == '.') continue;
-            snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 4, E.editor_width + 3);
-            abAppend(ab, buf, strlen(buf));
-            char entry[100];
-            int len = snprintf(entry, sizeof(entry), "%s", dir->d_name);
-            int sidebar_content_width = E.screencols - E.editor_width - 2;
-            if (len > sidebar_content_width) len = sidebar_content_width;
-            abAppend(ab, entry, len); y++;
+        screenMove(y + 1, E.editor_width);
+        screenSgr(COLOR_SIDEBAR_BORDER);
+        screenPut("│", 3);
+    }
+    screenMove(1, E.editor_width + 2);
+    screenSgr(COLOR_FG);
+    screenPut("EXPLORER", 8);
+    if (!m->path) return;
+    screenMove(2, E.editor_width + 2);
+    screenSgr(COLOR_LINENO);
+    if (m->load) {
+        screenPut("loading…", strlen("loading…"));
+        return;
+    }
+    const char *base = dirHasParent() ? strrchr(m->path, '/') + 1 : "/";
+    sidebarPut(base, strlen(base), width);
+    // Keep the selection in view.
+    int up = dirHasParent(), rows = m->n + up, height = E.screenrows - 2;
+    if (m->selected >= rows) m->selected = rows ? rows - 1 : 0;
+    if (m->selected < m->scroll) m->scroll = m->selected;
+    if (m->selected >= m->scroll + height) m->scroll = m->selected - height + 1;
+    if (m->scroll > rows - height) m->scroll = rows > height ? rows - height : 0;
+    for (int y = 0; y < height && m->scroll + y < rows; y++) {
+        int i = m->scroll + y - up;
+        const char *name = i < 0 ? ".." : m->e[i].name;
+        int is_dir = i < 0 || m->e[i].is_dir;
+        int selected = m->focus && m->scroll + y == m->selected;
+        screenMove(y + 3, E.editor_width + 2);
+        screenSgr(COLOR_FG);
+        if (selected) screenSgr(COLOR_SELECTION_BG);
+        int len = sidebarPut(name, strlen(name), width - is_dir);
+        if (is_dir) { screenPut("/", 1); len++; }
+        if (selected) {
+            while (len++ < width) screenPut(" ", 1);
+            screenSgr(COLOR_RESET);
         }
-        closedir(d);
     }
 }
-void editorDrawTitleBar(struct abuf *ab) {
-  abAppend(ab, COLOR_TITLE_BG, strlen(COLOR_TITLE_BG));
-  abAppend(ab, COLOR_STATUS_FG, strlen(COLOR_STATUS_FG));
+void editorDrawTitleBar() {
+  screenSgr(COLOR_TITLE_BG);
+  screenSgr(COLOR_STATUS_FG);
   char title[E.screencols + 1];
   snprintf(title, sizeof(title), " k8o4 — %s", E.filename ? E.filename : "[Untitled]");
   int len = strlen(title); if (len > E.screencols) len = E.screencols;
   int padding = (E.screencols - len) / 2;
-  for (int i = 0; i < padding; i++) abAppend(ab, " ", 1);
-  abAppend(ab, title, len);
-  while (len + padding < E.screencols) { abAppend(ab, " ", 1); len++; }
-  abAppend(ab, COLOR_RESET, strlen(COLOR_RESET)); abAppend(ab, "\r\n", 2);
-}
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, DYNAMIC_COLOR_STATUS_BG, strlen(DYNAMIC_COLOR_STATUS_BG));
-  abAppend(ab, COLOR_STATUS_FG, strlen(COLOR_STATUS_FG));
+  for (int i = 0; i < padding; i++) screenPut(" ", 1);
+  screenPut(title, len);
+  while (len + padding < E.screencols) { screenPut(" ", 1); len++; }
+  screenSgr(COLOR_RESET); screenMove(E.pen_y + 1, 0);
+}
+void editorDrawStatusBar() {
+  screenSgr(DYNAMIC_COLOR_STATUS_BG);
+  screenSgr(COLOR_STATUS_FG);
   char status[80];
-  int len = snprintf(status, sizeof(status), " NORMAL %s %s",
-                     E.filename ? E.filename : "[No Name]", E.dirty ? "●" : "");
+  int len = snprintf(status, sizeof(status), " %s %s %s",
+                     E.view ? "VIEW" : E.large ? "LARGE" : "NORMAL", E.filename ? E.filename : "[No Name]", E.dirty ? "●" : "");
   if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
-  abAppend(ab, DYNAMIC_COLOR_STATUS_FG_ARROW, strlen(DYNAMIC_COLOR_STATUS_FG_ARROW));
-  abAppend(ab, COLOR_STATUS_ALT_BG, strlen(COLOR_STATUS_ALT_BG));
-  abAppend(ab, PL_RIGHT_ARROW, strlen(PL_RIGHT_ARROW));
+  screenPut(status, len);
+  screenSgr(DYNAMIC_COLOR_STATUS_FG_ARROW);
+  screenSgr(COLOR_STATUS_ALT_BG);
+  screenPut(PL_RIGHT_ARROW, strlen(PL_RIGHT_ARROW));
   len++;
-  abAppend(ab, COLOR_STATUS_ALT_BG, strlen(COLOR_STATUS_ALT_BG));
-  abAppend(ab, COLOR_STATUS_FG, strlen(COLOR_STATUS_FG));
-  char rstatus[80];
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d:%d ",
+  screenSgr(COLOR_STATUS_ALT_BG);
+  screenSgr(COLOR_STATUS_FG);
+  char match[48] = "";
+  findState *f = &E.find;
+  if (f->error)
+    snprintf(match, sizeof(match), "bad regex: %s | ", f->error);
+  else if (f->nlevels && f->level[f->nlevels - 1].count)
+    snprintf(match, sizeof(match), "match %d of %d%s | ", f->current + 1,
+             f->level[f->nlevels - 1].count, f->scan ? "+" : "");
+  else if (f->nlevels)
+    snprintf(match, sizeof(match), "%s | ", f->scan ? "searching" : "no matches");
+  char saving[24] = "";
+  if (E.save && E.save->rows)
+    snprintf(saving, sizeof(saving), "saving %d%% | ",
+             (int)(__atomic_load_n(&E.save->done_rows, __ATOMIC_RELAXED) * 100LL / E.save->rows));
+  char rstatus[160];
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s | %d:%d ", saving, match,
                       E.syntax ? E.syntax->filetype : "text", E.cy + 1, E.cx + 1);
-  while (len < E.screencols - rlen) { abAppend(ab, " ", 1); len++; }
-  abAppend(ab, rstatus, rlen);
-  abAppend(ab, COLOR_RESET, strlen(COLOR_RESET)); abAppend(ab, "\r\n", 2);
+  while (len < E.screencols - rlen) { screenPut(" ", 1); len++; }
+  screenPut(rstatus, rlen);
+  screenSgr(COLOR_RESET); screenMove(E.pen_y + 1, 0);
 }
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+  screenClearEol();
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+    screenPut(E.statusmsg, msglen);
 }
-void editorRefreshScreen() {
+// Draw a frame into the back grid and append to ab the bytes that bring
+// the terminal up to date with it.
+void editorComposeFrame(struct abuf *ab) {
   editorScroll();
-  struct abuf ab = ABUF_INIT;
-  abAppend(&ab, "\x1b[?25l", 6); abAppend(&ab, "\x1b[H", 3);    
-  editorDrawTitleBar(&ab); editorDrawRows(&ab);
-  if (E.sidebar_visible) editorDrawSidebar(&ab);
-  editorDrawStatusBar(&ab); editorDrawMessageBar(&ab);
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 2,
-           (E.rx - E.coloff) + 6); 
-  abAppend(&ab, buf, strlen(buf));
-  abAppend(&ab, "\x1b[?25h", 6);
-  write(STDOUT_FILENO, ab.b, ab.len); abFree(&ab);
+  editorSyntaxAdvance(E.rowoff + E.screenrows, HL_FRAME_BUDGET);
+  screenBegin(E.screenrows + 3, E.screencols);
+  editorDrawTitleBar(); editorDrawRows();
+  if (E.sidebar_visible) editorDrawSidebar();
+  screenMove(E.screenrows + 1, 0);
+  editorDrawStatusBar(); editorDrawMessageBar();
+  screenFlush(ab, (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 5);
+}
+void editorRefreshScreen() {
+  static struct abuf ab = ABUF_INIT;
+  abReset(&ab);
+  editorComposeFrame(&ab);
+  abWrite(&ab, STDOUT_FILENO);
+  E.frame_bytes = ab.len; E.total_bytes += ab.len; E.frames++;
+  E.frame_pending = 0; E.frame_time = editorNow();
+}
+// While waiting for input, settle the highlighting past the screen a frame
+// budget at a time, yielding as soon as a key or a resize arrives. Ask for
+// a frame if rows that were on screen may have changed.
+void editorIdle() {
+  int from = E.hl_valid;
+  struct pollfd pfd[2] = {{ STDIN_FILENO, POLLIN, 0 }, { winch_wake[0], POLLIN, 0 }};
+  // A large file is only highlighted up to the screen, as it is drawn.
+  while (!E.large && E.hl_valid < E.numrows && poll(pfd, 2, 0) == 0)
+    editorSyntaxAdvance(E.numrows, HL_FRAME_BUDGET);
+  if (from < E.rowoff + E.screenrows) E.frame_pending = 1;
 }
 void editorSetStatusMessage(const char *fmt, ...) {
   va_list ap; va_start(ap, fmt);
   vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
   va_end(ap); E.statusmsg_time = time(NULL);
 }
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+// Read a line in the message bar. Enter on an empty line is ignored unless
+// allow_empty is set.
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allow_empty) {
   size_t bufsize = 128; char *buf = malloc(bufsize);
   size_t buflen = 0; buf[0] = '\0';
   while (1) {
-    editorSetStatusMessage(prompt, buf); editorRefreshScreen();
+    editorSetStatusMessage(prompt, buf); E.frame_pending = 1;
     int c = editorReadKey();
     if (c == DEL_KEY || c == 127 || c == BACKSPACE) {
       if (buflen != 0) buf[--buflen] = '\0';
@@ -1177,10 +4349,19 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       editorSetStatusMessage(""); if (callback) callback(buf, c);
       free(buf); return NULL;
     } else if (c == '\r') {
-      if (buflen != 0) {
+      if (buflen != 0 || allow_empty) {
         editorSetStatusMessage(""); if (callback) callback(buf, c);
         return buf;
       }
+    } else if (c == PASTE_START) {
+      // Take the first line of a paste, without control characters.
+      int len; char *text = editorReadPaste(&len);
+      for (int j = 0; j < len && text[j] != '\n'; j++) {
+        if (iscntrl((unsigned char)text[j])) continue;
+        if (buflen == bufsize - 1) { bufsize *= 2; buf = realloc(buf, bufsize); }
+        buf[buflen++] = text[j]; buf[buflen] = '\0';
+      }
+      free(text);
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) { bufsize *= 2; buf = realloc(buf, bufsize); }
       buf[buflen++] = c; buf[buflen] = '\0';
@@ -1189,11 +4370,11 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
   switch (key) {
   case ARROW_LEFT:
     if (E.cx != 0) E.cx--;
-    else if (E.cy > 0) { E.cy--; E.cx = E.row[E.cy].size; }
+    else if (E.cy > 0) { E.cy--; E.cx = editorRow(E.cy)->size; }
     break;
   case ARROW_RIGHT:
     if (row && E.cx < row->size) E.cx++;
@@ -1202,18 +4383,18 @@ void editorMoveCursor(int key) {
   case ARROW_UP: if (E.cy != 0) E.cy--; break;
   case ARROW_DOWN: if (E.cy < E.numrows) E.cy++; break;
   }
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) E.cx = rowlen;
 }
 void editorMoveCursorWordWise(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
     switch (key) {
         case CTRL_SHIFT_ARROW_LEFT:
             if (E.cx == 0) {
-                if (E.cy > 0) { E.cy--; E.cx = E.row[E.cy].size; }
+                if (E.cy > 0) { E.cy--; E.cx = editorRow(E.cy)->size; }
             } else {
-                row = &E.row[E.cy];
+                row = editorRow(E.cy);
                 E.cx--;
                 while (E.cx > 0 && is_separator(row->chars[E.cx])) { E.cx--; }
                 while (E.cx > 0 && !is_separator(row->chars[E.cx - 1])) { E.cx--; }
@@ -1241,7 +4422,7 @@ void editorStartOrExtendSelection(int key) {
         case SHIFT_ARROW_LEFT:  editorMoveCursor(ARROW_LEFT);  break;
         case SHIFT_ARROW_RIGHT: editorMoveCursor(ARROW_RIGHT); break;
         case SHIFT_HOME_KEY:    E.cx = 0; break;
-        case SHIFT_END_KEY:     if (E.cy < E.numrows) E.cx = E.row[E.cy].size; break;
+        case SHIFT_END_KEY:     if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size; break;
         case CTRL_SHIFT_ARROW_LEFT:
         case CTRL_SHIFT_ARROW_RIGHT:
             editorMoveCursorWordWise(key);
@@ -1250,36 +4431,87 @@ void editorStartOrExtendSelection(int key) {
     }
     E.sel_end_cy = E.cy; E.sel_end_cx = E.cx;
 }
+// Keys for the focused sidebar: move, drill into directories, open files.
+// Returns 0 for keys that should go to the buffer.
+int editorDirKey(int c) {
+  dirModel *m = &E.dir;
+  if (!m->path) return 0;  // Nothing could be read
+  int up = dirHasParent(), page = E.screenrows - 2;
+  int rows = m->load ? 0 : m->n + up;  // Nothing to act on until it lands
+  int i = m->selected - up;
+  switch (c) {
+  case ARROW_UP: if (m->selected > 0) m->selected--; break;
+  case ARROW_DOWN: if (m->selected < rows - 1) m->selected++; break;
+  case PAGE_UP: m->selected = m->selected > page ? m->selected - page : 0; break;
+  case PAGE_DOWN: m->selected = m->selected + page < rows ? m->selected + page : rows ? rows - 1 : 0; break;
+  case HOME_KEY: m->selected = 0; break;
+  case END_KEY: m->selected = rows ? rows - 1 : 0; break;
+  case '\x1b': m->focus = 0; break;
+  case ARROW_LEFT: case BACKSPACE: case ARROW_RIGHT: case '\r': {
+    if (m->load || i >= m->n) break;
+    int parent = c == ARROW_LEFT || c == BACKSPACE || i < 0;
+    if (parent && !up) break;
+    const char *name = parent ? ".." : m->e[i].name;
+    char path[strlen(m->path) + strlen(name) + 2];
+    sprintf(path, "%s/%s", up ? m->path : "", name);
+    if (parent || m->e[i].is_dir) {
+      editorDirOpen(path);
+    } else if (c == '\r') {
+      if (E.dirty) editorSetStatusMessage("Unsaved changes: save with Ctrl-S first");
+      else if (E.save) editorSetStatusMessage("Still saving");
+      else {
+        if (E.follow.ifd != -1) editorFollowStop();
+        editorLoad(path);
+        E.cy = E.cx = E.rowoff = E.coloff = 0;
+        m->focus = 0;
+      }
+    }
+  } break;
+  default: return 0;
+  }
+  return 1;
+}
 void editorProcessKeypress() {
   static int quit_times = QUIT_TIMES;
+  if (E.remap_size) editorRemap();
   int c = editorReadKey();
+  if (editorNow() - E.disk_checked >= DISK_CHECK_MS / 1e3) editorCheckDisk();
+  if (E.dir.focus && editorDirKey(c)) return;
   switch (c) {
   case '\r': editorInsertNewline(); break;
   case 24: // Ctrl-X
+    if (E.save) editorSaveFinish();
     if (E.dirty && quit_times > 0) {
       editorSetStatusMessage("WARNING! File has unsaved changes. "
                              "Press Ctrl-X %d more times to quit.", quit_times);
       quit_times--; return;
     }
+    journalDiscard();
     write(STDOUT_FILENO, "\x1b[2J", 4); write(STDOUT_FILENO, "\x1b[H", 3);
     write(STDOUT_FILENO, COLOR_RESET, strlen(COLOR_RESET)); exit(0);
     break;
   case 1: // Ctrl-A
     if (E.numrows > 0) {
         E.selection_active = 1; E.sel_start_cy = 0; E.sel_start_cx = 0;
-        E.sel_end_cy = E.numrows - 1; E.sel_end_cx = E.row[E.numrows - 1].size;
+        E.sel_end_cy = E.numrows - 1; E.sel_end_cx = editorRow(E.numrows - 1)->size;
     }
     break;
   case 26: editorUndo(); break; // Ctrl-Z
   case 25: editorRedo(); break; // Ctrl-Y
   case 19: editorSave(); break; // Ctrl-S
-  case 6: editorFind(); break; // Ctrl-F
-  case 5: // Ctrl-E
+  case 6: editorFind(0); break; // Ctrl-F
+  case 18: editorFind(1); break; // Ctrl-R
+  case 28: editorReplace(); break; // Ctrl-Backslash, as in nano
+  case 20: editorFollowToggle(); break; // Ctrl-T
+  case 5: // Ctrl-E: show and focus the sidebar, then hide it
+    if (E.sidebar_visible && !E.dir.focus && E.dir.path) { E.dir.focus = 1; break; }
     E.sidebar_visible = !E.sidebar_visible;
+    if (E.sidebar_visible && !E.dir.path) editorDirOpen(".");
+    E.dir.focus = E.sidebar_visible && E.dir.path;
     E.editor_width = E.screencols - (E.sidebar_visible ? 25 : 5);
     break;
   case HOME_KEY: E.cx = 0; editorClearSelection(); break;
-  case END_KEY: if (E.cy < E.numrows) E.cx = E.row[E.cy].size; editorClearSelection(); break;
+  case END_KEY: if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size; editorClearSelection(); break;
   
   case BACKSPACE:
     if (E.selection_active) editorDeleteSelection(); else editorDelChar();
@@ -1301,7 +4533,7 @@ void editorProcessKeypress() {
   case CTRL_ARROW_LEFT: editorClearSelection(); E.cx = 0; break;
   case CTRL_ARROW_RIGHT:
     editorClearSelection();
-    if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+    if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size;
     break;
   case CTRL_ARROW_UP:
   case CTRL_ARROW_DOWN:
@@ -1315,24 +4547,374 @@ void editorProcessKeypress() {
     editorStartOrExtendSelection(c);
     break;
   case 12: case '\x1b': editorClearSelection(); break; // Ctrl-L (clear), ESC
+  case PASTE_START: editorPaste(); break;
+  case PASTE_END: break;
   default: editorInsertChar(c); break;
   }
   quit_times = QUIT_TIMES;
 }
 void initEditor() {
   E.cx = 0; E.cy = 0; E.rx = 0; E.rowoff = 0; E.coloff = 0; E.numrows = 0;
-  E.row = NULL; E.dirty = 0; E.filename = NULL; E.statusmsg[0] = '\0';
+  E.rows = NULL; E.dirty = 0; E.filename = NULL; E.statusmsg[0] = '\0';
   E.statusmsg_time = 0; E.syntax = NULL; E.sidebar_visible = 0;
   E.selection_active = 0;
-  E.undo_head = NULL;
-  E.undo_current = NULL;
-  E.undo_count = 0;
+  E.undo_first = E.undo_last = E.undo_chunk = NULL;
+  E.undo_pos = E.undo_bytes = 0;
+  E.undo_open = 0;
   E.in_undo = 0;
+  E.map = NULL; E.map_size = 0; E.line_off = NULL;
+  E.hl_valid = 0; E.lru_head = E.lru_tail = NULL; E.lru_count = 0;
+  E.journal.fd = -1;
+  E.follow.ifd = E.follow.fd = -1;
+  E.dir.ifd = E.dir.wd = -1;
+  editorResize();
+}
+// Take the new window size after a SIGWINCH, and at startup.
+void editorResize() {
+  char drain[64];
+  while (winch_wake[0] != -1 && read(winch_wake[0], drain, sizeof(drain)) > 0);
   if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
   E.screenrows -= 3;
   E.editor_width = E.screencols - (E.sidebar_visible ? 25 : 5);
+  E.frame_pending = 1;
+}
+// Benchmarks: k8o4 --bench <what> FILE, timed on the mapped file.
+void benchIndex(const char *name, const char *buf, size_t len,
+                indexKernel kernel, int threads) {
+  double best = 1e9; int lines = 0;
+  for (int rep = 0; rep < 5; rep++) {
+    size_t *off;
+    double start = editorNow();
+    lines = lineIndexBuild(buf, len, &off, kernel, threads);
+    double elapsed = editorNow() - start;
+    free(off);
+    if (elapsed < best) best = elapsed;
+  }
+  printf("index %-6s %2d thread(s): %d lines in %.2f ms, %.0f MB/s, %.1f Mlines/s\n",
+         name, threads, lines, best * 1e3, len / best / 1e6, lines / best / 1e6);
+}
+void benchHighlight(const char *map, size_t len) {
+  size_t *off;
+  int lines = editorIndexLines(map, len, &off);
+  // A copy with every terminator turned into a NUL, as rows are.
+  char *text = malloc(len + 1);
+  memcpy(text, map, len);
+  text[len] = '\0';
+  for (int j = 0; j < lines; j++) text[off[j + 1] - 1] = '\0';
+  unsigned char *hl = malloc(len + 1);
+  double best = 1e9;
+  for (int rep = 0; rep < 5; rep++) {
+    int in_comment = 0;
+    double start = editorNow();
+    for (int j = 0; j < lines; j++)
+      in_comment = editorHighlightText(&text[off[j]], off[j + 1] - 1 - off[j], in_comment, hl);
+    double elapsed = editorNow() - start;
+    if (elapsed < best) best = elapsed;
+  }
+  printf("highlight %s: %d lines in %.2f ms, %.0f MB/s, %.1f Mlines/s\n",
+         E.syntax->filetype, lines, best * 1e3, len / best / 1e6, lines / best / 1e6);
+  free(hl); free(text); free(off);
+}
+// Bytes written per frame while moving the cursor, typing and scrolling on
+// a 120x50 screen, next to what repainting every cell would have cost.
+void benchRenderRun(const char *name, int key, int frames) {
+  static struct abuf ab = ABUF_INIT;
+  long long diff = 0, full = 0;
+  for (int j = 0; j < frames; j++) {
+    if (key == 'x') editorInsertChar(key); else editorMoveCursor(key);
+    abReset(&ab);
+    editorComposeFrame(&ab);
+    diff += ab.len;
+    memset(E.front, 0, E.grid_rows * E.grid_cols * sizeof(screenCell));
+    E.term_y = E.term_fg = E.term_bg = -1;
+    abReset(&ab);
+    editorComposeFrame(&ab);
+    full += ab.len;
+  }
+  printf("render %-6s: %6.0f bytes/frame, %6.0f for a full repaint\n",
+         name, (double)diff / frames, (double)full / frames);
+}
+void benchRender(char *filename) {
+  E.screenrows = 50 - 3; E.screencols = 120; E.editor_width = E.screencols - 5;
+  strcpy(DYNAMIC_COLOR_STATUS_BG, "\x1b[48;2;0;122;204m");
+  strcpy(DYNAMIC_COLOR_STATUS_FG_ARROW, "\x1b[38;2;0;122;204m");
+  editorOpen(filename);
+  struct abuf ab = ABUF_INIT;
+  editorComposeFrame(&ab);
+  abFree(&ab);
+  benchRenderRun("cursor", ARROW_RIGHT, 40);
+  benchRenderRun("type", 'x', 40);
+  benchRenderRun("down", ARROW_DOWN, 200);
+}
+void benchSearchKernel(const char *name, const char *buf, size_t len,
+                       const char *q, findKernel kernel) {
+  size_t qlen = strlen(q);
+  double best = 1e9; int count = 0;
+  for (int rep = 0; rep < 5; rep++) {
+    const char *p = buf, *end = buf + len;
+    count = 0;
+    double start = editorNow();
+    while (p < end && (p = kernel(p, end - p, q, qlen)) != NULL) { count++; p++; }
+    double elapsed = editorNow() - start;
+    if (elapsed < best) best = elapsed;
+  }
+  printf("search %-6s: %d matches in %.2f ms, %.0f MB/s\n",
+         name, count, best * 1e3, len / best / 1e6);
+}
+void benchSearchWait(findState *f) {
+  while (f->scan) {
+    struct pollfd pfd = { find_wake[0], POLLIN, 0 };
+    poll(&pfd, 1, -1);
+    findScanCollect(f);
+  }
+}
+// Kernel throughput over the mapped file, a full scan of the buffer on the
+// UI thread and on workers, then the prompt typing the query one key at a
+// time: each prefix after the first narrows the one before.
+void benchSearch(char *filename, const char *q) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) { perror(filename); return; }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { perror("mmap"); return; }
+  benchSearchKernel("scalar", map, st.st_size, q, findScalar);
+#ifdef __SSE2__
+  benchSearchKernel("sse2", map, st.st_size, q, findSSE2);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) benchSearchKernel("avx2", map, st.st_size, q, findAVX2);
+#endif
+  munmap(map, st.st_size);
+  editorOpen(filename);
+  int qlen = strlen(q);
+  int render = strchr(q, ' ') != NULL;
+  findReset(&E.find);
+  double start = editorNow();
+  findScanAll(&E.find, q, qlen, render);
+  printf("search buffer : %d matches in %.2f ms on 1 thread\n",
+         E.find.level[0].count, (editorNow() - start) * 1e3);
+  findReset(&E.find);
+  start = editorNow();
+  if (findScanStart(&E.find, q, qlen, render) == 0) {
+    int threads = E.find.scan->nthreads;
+    benchSearchWait(&E.find);
+    printf("search buffer : %d matches in %.2f ms on %d threads\n",
+           E.find.level[0].count, (editorNow() - start) * 1e3, threads);
+  }
+  findReset(&E.find);
+  for (int j = 1; j <= qlen; j++) {
+    double start = editorNow();
+    findUpdate(&E.find, q, j);
+    benchSearchWait(&E.find);
+    double elapsed = editorNow() - start;
+    printf("search prefix %-3d: %d matches in %.2f ms\n",
+           j, E.find.level[E.find.nlevels - 1].count, elapsed * 1e3);
+  }
+}
+// A regex search of the whole buffer on one thread, the DFAs built as it goes.
+void benchRegex(char *filename, const char *pattern) {
+  const char *error;
+  editorOpen(filename);
+  findState *f = &E.find;
+  findReset(f);
+  f->regex = 1;
+  if (!(f->re = regexCompile(pattern, &error))) { fprintf(stderr, "%s\n", error); return; }
+  f->rm = regexMatcherNew(f->re);
+  size_t bytes = 0;
+  for (int j = 0; j < E.numrows; j++) {
+    int off = 0, len; editorFindText(rowTreeAt(j, &off), off, 0, &len);
+    bytes += len;
+  }
+  for (int rep = 0; rep < 3; rep++) {
+    f->found.n = f->nlevels = 0;
+    double start = editorNow();
+    findScanAll(f, pattern, strlen(pattern), 0);
+    double elapsed = editorNow() - start;
+    printf("regex %s: %d matches in %.2f ms, %.0f MB/s, %d+%d DFA states\n",
+           rep ? "warm" : "cold", f->level[0].count, elapsed * 1e3, bytes / elapsed / 1e6,
+           f->rm->fwd.nstates, f->rm->rev.nstates);
+  }
+  // A pattern whose runs from each start overlap, on a long line.
+  int len = 1 << 20;
+  char *line = malloc(len);
+  memset(line, 'a', len);
+  regex *re = regexCompile("a|.*b", &error);
+  regexMatcher *rm = regexMatcherNew(re);
+  findVec v = {0};
+  double start = editorNow();
+  regexScanText(rm, &v, 0, line, len);
+  printf("regex a|.*b on a 1 MB line of a's: %d matches in %.2f ms\n", v.n, (editorNow() - start) * 1e3);
+  free(v.m); free(line); regexMatcherFree(rm); regexFree(re);
+}
+// Replace-all over the whole buffer, then undoing and redoing it.
+void benchReplace(char *filename, const char *q, const char *with) {
+  editorOpen(filename);
+  double start = editorNow();
+  int n = editorReplaceAll(q, with);
+  printf("replace all: %d matches in %.2f ms\n", n, (editorNow() - start) * 1e3);
+  if (!n) return;
+  start = editorNow();
+  editorUndo();
+  printf("replace undo: %.2f ms\n", (editorNow() - start) * 1e3);
+  start = editorNow();
+  editorRedo();
+  printf("replace redo: %.2f ms\n", (editorNow() - start) * 1e3);
+}
+// Type FILE into an empty buffer a key at a time, then undo and redo it all.
+void benchUndo(char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp) { perror(filename); return; }
+  int c, keys = 0, records = 0, steps = 0;
+  double start = editorNow();
+  while ((c = getc(fp)) != EOF) {
+    if (c == '\n') editorInsertNewline(); else if (c != '\r') editorInsertChar(c);
+    keys++;
+  }
+  fclose(fp);
+  double elapsed = editorNow() - start;
+  size_t used = 0;
+  for (undoChunk *chunk = E.undo_first; chunk; chunk = chunk->next) {
+    for (size_t off = 0; off < chunk->used; records++) {
+      undoRecord *r = (undoRecord *)(chunk->data + off);
+      off += undoRecordSize(r->len + r->with_len, r->num_matches);
+    }
+    used += chunk->used;
+  }
+  printf("undo type: %d keys in %.2f ms, %d records, %zu bytes of history, %.1f per key\n",
+         keys, elapsed * 1e3, records, used, (double)used / keys);
+  undoChunk *chunk; size_t off;
+  start = editorNow();
+  for (; undoCurrent(&chunk, &off); steps++) editorUndo();
+  printf("undo all: %d steps in %.2f ms, %d rows left\n", steps, (editorNow() - start) * 1e3, E.numrows);
+  start = editorNow();
+  for (steps = 0; undoNext(&chunk, &off); steps++) editorRedo();
+  printf("redo all: %d steps in %.2f ms, %d rows\n", steps, (editorNow() - start) * 1e3, E.numrows);
+  E.selection_active = 1; E.sel_start_cy = E.sel_start_cx = 0;
+  E.sel_end_cy = E.numrows - 1; E.sel_end_cx = editorRow(E.numrows - 1)->size;
+  start = editorNow();
+  editorDeleteSelection();
+  double deleted = editorNow() - start;
+  start = editorNow();
+  editorUndo();
+  double restored = editorNow() - start;
+  start = editorNow();
+  editorRedo();
+  printf("undo select all: delete %.2f ms, undo %.2f ms, redo %.2f ms\n",
+         deleted * 1e3, restored * 1e3, (editorNow() - start) * 1e3);
+}
+// Paste FILE into the middle of itself as one edit, then undo and redo it.
+void benchPaste(char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp) { perror(filename); return; }
+  size_t cap = 65536, len = 0, n;
+  char *text = malloc(cap);
+  while ((n = fread(text + len, 1, cap - len, fp)) > 0)
+    if ((len += n) == cap) text = realloc(text, cap *= 2);
+  fclose(fp);
+  editorOpen(filename);
+  E.cy = E.numrows / 2; E.cx = 0;
+  double start = editorNow();
+  editorPasteText(text, len);
+  printf("paste: %zu bytes in %.2f ms, %d rows\n", len, (editorNow() - start) * 1e3, E.numrows);
+  start = editorNow();
+  editorUndo();
+  printf("paste undo: %.2f ms, %d rows\n", (editorNow() - start) * 1e3, E.numrows);
+  start = editorNow();
+  editorRedo();
+  printf("paste redo: %.2f ms, %d rows\n", (editorNow() - start) * 1e3, E.numrows);
+  free(text);
+}
+// Save FILE, with a line typed in its middle, to OUT.
+void benchSave(char *filename, char *out) {
+  editorOpen(filename);
+  E.cy = E.numrows / 2; E.cx = 0;
+  for (const char *p = "edited "; *p; p++) editorInsertChar(*p);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  long before = ru.ru_maxrss;
+  double start = editorNow();
+  saveJob *s = saveSnapshot(out);
+  double snap = editorNow() - start;
+  start = editorNow();
+  ssize_t len = editorWriteFile(s);
+  if (len == -1) { perror(out); return; }
+  double took = editorNow() - start;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("save: %zd bytes, snapshot %.2f ms, write %.2f ms, %.0f MB/s, peak RSS %ld KB before, %ld KB after\n",
+         len, snap * 1e3, took * 1e3, len / took / 1e6, before, ru.ru_maxrss);
+  saveFree(s);
+  // Again in the background, typing on the saved rows until it is done.
+  E.save = saveSnapshot(out);
+  if (pthread_create(&E.save->tid, NULL, saveThread, E.save) != 0) return;
+  E.save->threaded = 1;
+  int keys = 0; double worst = 0;
+  start = editorNow();
+  while (!__atomic_load_n(&E.save->done, __ATOMIC_ACQUIRE)) {
+    double t = editorNow();
+    editorInsertChar('x');
+    if (++keys % 80 == 0) { editorInsertNewline(); E.cy = (E.cy * 7919LL) % E.numrows; E.cx = 0; }
+    if (editorNow() - t > worst) worst = editorNow() - t;
+  }
+  took = editorNow() - start;
+  len = E.save->error ? -1 : (ssize_t)E.save->total;
+  editorSaveFinish();
+  printf("background save: %zd bytes in %.2f ms, %d keys typed meanwhile, slowest %.1f us, dirty %d\n",
+         len, took * 1e3, keys, worst * 1e6, E.dirty != 0);
+}
+int editorBenchmark(int argc, char *argv[]) {
+  int query = argc >= 1 && (!strcmp(argv[0], "search") || !strcmp(argv[0], "regex"));
+  int replace = argc >= 1 && !strcmp(argv[0], "replace");
+  int save = argc >= 1 && !strcmp(argv[0], "save");
+  if (argc < 2 || (strcmp(argv[0], "index") && strcmp(argv[0], "highlight") &&
+                    strcmp(argv[0], "render") && strcmp(argv[0], "undo") &&
+                    strcmp(argv[0], "paste") && !query && !replace && !save) ||
+      (save && argc < 3) ||
+      (query && (argc < 3 || !argv[2][0])) || (replace && (argc < 4 || !argv[2][0]))) {
+    fprintf(stderr, "usage: k8o4 --bench index|highlight|render|undo|paste FILE\n"
+                    "       k8o4 --bench search|regex FILE QUERY\n"
+                    "       k8o4 --bench replace FILE QUERY WITH\n"
+                    "       k8o4 --bench save FILE OUT\n");
+    return 1;
+  }
+  if (replace) { benchReplace(argv[1], argv[2], argv[3]); return 0; }
+  if (save) { benchSave(argv[1], argv[2]); return 0; }
+  if (!strcmp(argv[0], "render")) { benchRender(argv[1]); return 0; }
+  if (!strcmp(argv[0], "undo")) { benchUndo(argv[1]); return 0; }
+  if (!strcmp(argv[0], "paste")) { benchPaste(argv[1]); return 0; }
+  if (!strcmp(argv[0], "search")) { benchSearch(argv[1], argv[2]); return 0; }
+  if (!strcmp(argv[0], "regex")) { benchRegex(argv[1], argv[2]); return 0; }
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) { perror(argv[1]); return 1; }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { perror("mmap"); return 1; }
+  if (!strcmp(argv[0], "highlight")) {
+    E.filename = strdup(argv[1]);
+    editorSelectSyntaxHighlight();
+    if (!E.syntax) { fprintf(stderr, "%s: no syntax for this file type\n", argv[1]); return 1; }
+    benchHighlight(map, st.st_size);
+    munmap(map, st.st_size);
+    return 0;
+  }
+  int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  benchIndex("scalar", map, st.st_size, indexScalar, 1);
+#ifdef __SSE2__
+  benchIndex("sse2", map, st.st_size, indexSSE2, 1);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) benchIndex("avx2", map, st.st_size, indexAVX2, 1);
+#endif
+  if (ncpu > 1) benchIndex("best", map, st.st_size, editorIndexKernel(), ncpu);
+  munmap(map, st.st_size);
+  return 0;
 }
 int main(int argc, char *argv[]) {
+  if (argc >= 2 && !strcmp(argv[1], "--bench"))
+    return editorBenchmark(argc - 2, argv + 2);
+  int follow = argc >= 3 && !strcmp(argv[1], "-f");  // k8o4 -f FILE follows it
+  if (follow) { argv++; argc--; }
   if (!isatty(STDOUT_FILENO)) {
     if (argc < 2) return 1;
     FILE *fp = fopen(argv[1], "r");
@@ -1350,10 +4932,19 @@ int main(int argc, char *argv[]) {
   int r = rand() % 256; int g = rand() % 256; int b = rand() % 256;
   snprintf(DYNAMIC_COLOR_STATUS_BG, sizeof(DYNAMIC_COLOR_STATUS_BG), "\x1b[48;2;%d;%d;%dm", r, g, b);
   snprintf(DYNAMIC_COLOR_STATUS_FG_ARROW, sizeof(DYNAMIC_COLOR_STATUS_FG_ARROW), "\x1b[38;2;%d;%d;%dm", r, g, b);
-  if (argc >= 2) { editorOpen(argv[1]); }
   editorSetStatusMessage("HELP: Ctrl-S Save | Ctrl-X Quit | Ctrl-Z Undo | Ctrl-Y Redo");
+  // No mask to restore when a fault jumps out of the handler.
+  struct sigaction bus = { .sa_handler = editorMapFault, .sa_flags = SA_NODEFER };
+  sigaction(SIGBUS, &bus, NULL);
+  if (argc >= 2) { editorOpen(argv[1]); journalRecover(); }
+  if (follow) editorFollowToggle();
+  if (pipe(winch_wake) == -1) die("pipe");
+  fcntl(winch_wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(winch_wake[1], F_SETFL, O_NONBLOCK);
+  struct sigaction sa = { .sa_handler = editorWinch, .sa_flags = SA_RESTART };
+  sigaction(SIGWINCH, &sa, NULL);
   while (1) {
-    editorRefreshScreen(); editorProcessKeypress();
+    E.frame_pending = 1; editorProcessKeypress();
   }
   return 0;
 }